@@ -17,8 +17,44 @@
  *****************************************************************************
  */
 
-uint8_t MM_BT_init(void);
-uint8_t MM_BT_getPhrase(void);
+// Command bytes from app. Control data only uses the 3 LSBs, so any byte
+// with the MSB set is treated as a command rather than XYZ values.
+#define MM_BT_CMD_FLAG      0x80
+#define MM_BT_CMD_TRACE     0x81    // dump event trace buffer
+#define MM_BT_CMD_LATENCY   0x82    // report gesture-to-actuation latency
+#define MM_BT_CMD_TLM_RATE  0x90    // 0x9N: telemetry every N * 250ms, N=0 off
+#define MM_BT_CMD_ESTOP     MM_ESTOP_BYTE   // emergency stop, acted on in ISR
+#define MM_BT_CMD_RESUME    0xEF    // release emergency stop
+
+// Baud rate to run the module at, negotiated by MM_BT_initPoll(). Set to 
+// MM_BT_BAUD to stay at the startup rate.
+#ifndef MM_BT_BAUD_FAST
+#define MM_BT_BAUD_FAST     MM_BAUD_115200
+#endif
+
+// timeouts for module replies, in ms
+#define MM_BT_AT_TIMEOUT_MS     100     // reply to "AT", per rate scanned
+#define MM_BT_BAUD_TIMEOUT_MS   1000    // reply to "AT+BAUDn"
+#define MM_BT_QUIET_MS          20      // end of reply
+
+// timeouts for phrases from app, in ms
+#define MM_BT_PHRASE_WAIT_MS    1000    // start of phrase
+#define MM_BT_CHAR_TIMEOUT_MS   100     // between chars of a phrase
+
+// result of MM_BT_getPhrase()
+typedef enum {
+    MM_BT_PHRASE_OK,        // phrase stored at MM_PHRASES[MM_PHR_INDEX]
+    MM_BT_PHRASE_LAST,      // app signalled there are no more phrases
+    MM_BT_PHRASE_TIMEOUT,   // no phrase, or phrase cut off
+} MM_bt_phrase_status;
+
+// wait between failed scans, doubling from min to max, in ms
+#define MM_BT_BACKOFF_MIN_MS    100
+#define MM_BT_BACKOFF_MAX_MS    2000
+
+MM_init_status MM_BT_initPoll(void);
+uint8_t MM_BT_resume(void);
+MM_bt_phrase_status MM_BT_getPhrase(void);
 void MM_BT_getXYZ(void);
 
 #endif
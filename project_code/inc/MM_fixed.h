@@ -0,0 +1,33 @@
+#ifndef MM_FIXED_H
+#define MM_FIXED_H
+
+#include <stdint.h>
+
+/**********************************************************************************
+ * @File     MM_fixed.h
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Fixed-point maths for the MiniMech robot. See MM_fixed.c for
+ *           details of operation.
+ **********************************************************************************
+ * Q15 values are int16_t, representing -1.0 <= x < 1.0. All arithmetic
+ * saturates rather than wrapping, so motor and control code never sees a
+ * full-on value flip to full-reverse.
+ **********************************************************************************/
+
+typedef int16_t MM_q15;
+
+#define MM_Q15_MAX  ((MM_q15)32767)
+#define MM_Q15_MIN  ((MM_q15)-32768)
+
+// Convert a constant to Q15, 1.0 becomes the max value. Only use with
+// constants, so the float maths is done by the compiler.
+#define MM_Q15(x)   ((MM_q15)((x) >= 1.0 ? 32767 : (x) * 32768))
+
+MM_q15 MM_FX_add15(MM_q15 a, MM_q15 b);
+MM_q15 MM_FX_sub15(MM_q15 a, MM_q15 b);
+MM_q15 MM_FX_mul15(MM_q15 a, MM_q15 b);
+MM_q15 MM_FX_clamp15(MM_q15 x, MM_q15 lo, MM_q15 hi);
+uint16_t MM_FX_scale15(MM_q15 x, uint16_t n);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef MM_LATENCY_H
+#define MM_LATENCY_H
+
+#include <stdint.h>
+
+/**********************************************************************************
+ * @File     MM_latency.h
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Gesture-to-actuation latency measurement for the MiniMech robot.
+ *           See MM_latency.c for details of operation.
+ **********************************************************************************/
+
+// number of histogram buckets. Bucket n holds samples of bit length n,
+// ie 2^(n-1) <= sample < 2^n, so 17 buckets cover all 16-bit samples.
+#define MM_LAT_BUCKETS 17
+
+// A gesture not reaching the motors within this many ms of arriving is 
+// dropped, as it didn't change them (eg. into SPEAK). Must be under half 
+// the stamp wrap (~262ms), or a late sample could wrap to a small one.
+#define MM_LAT_EXPIRE_MS 250
+
+// report frame sync bytes
+#define MM_LAT_SYNC_1 0xA5
+#define MM_LAT_SYNC_2 0x4C
+
+// mark arrival of a control frame that changed MM_CONTROL, at 'stamp' 
+// (MM_MCU_getStamp()) and 'tick' (MM_MCU_getTicks())
+void MM_LAT_frameIn(uint16_t stamp, uint16_t tick);
+// mark a motor change (on/off or new duty target), completes any pending
+// measurement. Called from the control loop ISR.
+void MM_LAT_actuated(void);
+// send latency statistics to app
+void MM_LAT_report(void);
+
+#endif
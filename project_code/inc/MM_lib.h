@@ -32,6 +32,14 @@ typedef enum {
     MM_MOTOR_R
 } MM_motor;
 
+// Control loop rate in Hz. Motor mixing, ramps, link supervision and
+// output commit run from a timer interrupt at this rate, however fast the
+// main loop is going. Must divide 1000.
+#ifndef MM_CTRL_HZ
+#define MM_CTRL_HZ          200
+#endif
+#define MM_CTRL_PERIOD_MS   (1000 / MM_CTRL_HZ)
+
 // states of motors
 typedef enum {
     MM_MOTOR_OFF,
@@ -53,6 +61,13 @@ typedef enum {
 } MM_led_state;
 
 
+// result of polling a module's non-blocking initialisation
+typedef enum {
+    MM_INIT_BUSY,
+    MM_INIT_OK,
+    MM_INIT_FAIL,
+} MM_init_status;
+
 // Store phrases to be sent to text-to-speech module. 249 max chars + null byte.
 extern char MM_PHRASES[10][250];
 // phrase array index
@@ -0,0 +1,70 @@
+#ifndef MM_RAMP_H
+#define MM_RAMP_H
+
+#include <stdint.h>
+#include <MM_fixed.h>
+#include <MM_lib.h>
+
+/**********************************************************************************
+ * @File     MM_ramp.h
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Ramp generator for motor duty on the MiniMech robot. See
+ *           MM_ramp.c for details of operation.
+ **********************************************************************************/
+
+// Time for each motor to ramp from off to full, and full to off, in ms.
+// Limits inrush current, which can brown out the MCU on a low battery.
+#ifndef MM_RAMP_UP_MS_L
+#define MM_RAMP_UP_MS_L     250
+#endif
+#ifndef MM_RAMP_UP_MS_R
+#define MM_RAMP_UP_MS_R     250
+#endif
+#ifndef MM_RAMP_DOWN_MS_L
+#define MM_RAMP_DOWN_MS_L   100
+#endif
+#ifndef MM_RAMP_DOWN_MS_R
+#define MM_RAMP_DOWN_MS_R   100
+#endif
+
+// Time to reach the faster ramp rate, in ms, giving an S-curve that 
+// removes the lurch at each end of a ramp. 0 for plain linear ramps.
+#ifndef MM_RAMP_JERK_MS
+#define MM_RAMP_JERK_MS     50
+#endif
+
+// Q15 rates per control period (MM_CTRL_PERIOD_MS) for ramp times above,
+// at least 1
+#define MM_RAMP_RATE(ms)    ((MM_q15)(((ms) > MM_CTRL_PERIOD_MS) ? \
+    (((int32_t)MM_Q15_MAX * MM_CTRL_PERIOD_MS) / (ms)) : MM_Q15_MAX))
+#define MM_RAMP_ACCEL(ms)   ((MM_q15)(MM_RAMP_JERK_MS ? \
+    ((((int32_t)MM_RAMP_RATE(ms) * MM_CTRL_PERIOD_MS / MM_RAMP_JERK_MS)) | 1) : 0))
+
+// ramp limits, MM_RAMP_CFG() builds one from the ramp times above
+typedef struct {
+    MM_q15 up;      // max duty increase per tick
+    MM_q15 down;    // max duty decrease per tick
+    MM_q15 accel;   // max rate change per tick, 0 for linear ramps
+} MM_ramp_cfg;
+
+#define MM_RAMP_CFG(up_ms, down_ms) \
+    { MM_RAMP_RATE(up_ms), MM_RAMP_RATE(down_ms), \
+      MM_RAMP_ACCEL((up_ms) < (down_ms) ? (up_ms) : (down_ms)) }
+
+// a single ramp, duty values 0 to MM_Q15_MAX
+typedef struct {
+    const MM_ramp_cfg * cfg;
+    MM_q15 target;
+    MM_q15 value;
+    MM_q15 rate;    // signed, duty change per tick
+} MM_ramp;
+
+// set value to ramp towards
+void MM_RAMP_set(MM_ramp * ramp, MM_q15 target);
+// advance by one control period, returns new value
+MM_q15 MM_RAMP_tick(MM_ramp * ramp);
+// stop dead, target and value 0
+void MM_RAMP_stop(MM_ramp * ramp);
+
+#endif
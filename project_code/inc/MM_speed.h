@@ -0,0 +1,51 @@
+#ifndef MM_SPEED_H
+#define MM_SPEED_H
+
+#include <stdint.h>
+#include <MM_fixed.h>
+
+/**********************************************************************************
+ * @File     MM_speed.h
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Wheel speed matching for the MiniMech robot. See MM_speed.c
+ *           for details of operation.
+ **********************************************************************************/
+
+// Wheel encoder source. None runs the motors open loop as before.
+#define MM_ENCODER_NONE     0
+#define MM_ENCODER_TIM1     1   // slotted wheels on TIM1 CH1 (L), CH2 (R)
+#define MM_ENCODER_SIM      2   // simulated wheels, for testing without
+#ifndef MM_ENCODER
+#define MM_ENCODER          MM_ENCODER_NONE
+#endif
+
+// speed loop period, in ms. Must be a multiple of MM_CTRL_PERIOD_MS.
+#define MM_SPEED_PERIOD_MS      20
+// encoder edges per period at full duty, sets error scaling
+#define MM_SPEED_FULL_COUNTS    40
+
+// PI gains, in duty per unit of speed error (Q15), and correction limit
+#define MM_SPEED_KP         MM_Q15(0.5)
+#define MM_SPEED_KI         MM_Q15(0.05)
+#define MM_SPEED_CORR_MAX   MM_Q15(0.25)
+
+// Simulated wheels. Left motor is weaker, so the loop has something to
+// correct. Speed lags duty with a time constant of 2^MM_SIM_LAG_SHIFT ms.
+#define MM_SIM_GAIN_L       MM_Q15(0.85)
+#define MM_SIM_GAIN_R       MM_Q15(1.0)
+#define MM_SIM_LAG_SHIFT    4
+
+// encoder edges counted last period, for debugging
+extern uint16_t MM_SPEED_COUNT_L;
+extern uint16_t MM_SPEED_COUNT_R;
+// last correction, > 0 means left wheel was fast
+extern MM_q15 MM_SPEED_CORR;
+
+// run PI loop on one period's edge counts, returns correction
+MM_q15 MM_SPEED_update(uint16_t count_l, uint16_t count_r, uint8_t straight);
+// advance simulated wheels by 1ms, adding their edges to counts
+void MM_SPEED_simTick(MM_q15 duty_l, MM_q15 duty_r,
+                      uint16_t * count_l, uint16_t * count_r);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stm8s.h>
 #include <MM_lib.h>
+#include <MM_fixed.h>
 
 /*********************************************************************************
  * @File     MM_stm8s.h
@@ -16,11 +17,410 @@
  * It is designed for use with the SPM8S208CB microcontroller.
  **********************************************************************************/
 
+// system tick, incremented every 1ms by the TIM4 update interrupt
+extern volatile uint16_t MM_TICKS;
+
+// resolution of MM_MCU_getStamp() in microseconds (one TIM4 count)
+#define MM_STAMP_US 8
+
+// RAM layout. Static data from MM_RAM_START upward, stack grows down 
+// from MM_RAM_END.
+#define MM_RAM_START    0x0000
+#define MM_RAM_END      0x17FF
+// fill pattern for unused stack, see MM_MCU_stackPaint()
+#define MM_STACK_PAINT  0xAA
+
+// Pin map for LEDs and motors, X(device, port letter, pin number). Change
+// pins here only, everything else is generated from these tables. LEDs
+// must stay on port A and motors on port B (see MM_MCU_applyOutputs()).
+#define MM_LED_PINS(X) \
+    X(MM_LED_BLUE,   A, 0) \
+    X(MM_LED_GREEN,  A, 1) \
+    X(MM_LED_RED,    A, 2) \
+    X(MM_LED_ORANGE, A, 3)
+
+#define MM_MOTOR_PINS(X) \
+    X(MM_MOTOR_R, B, 0) \
+    X(MM_MOTOR_L, B, 1)
+
+// Single bit writes to the shadow of an output register. These are what
+// the FSM uses, the shadows are handed to the control loop by 
+// MM_MCU_commitOutputs().
+#define MM_OUT_HIGH(port, pin)      (MM_OUT_##port |= (uint8_t)(1 << (pin)))
+#define MM_OUT_LOW(port, pin)       (MM_OUT_##port &= (uint8_t)~(1 << (pin)))
+
+// pin masks for each port, generated from pin map
+#define MM_X_MASK(dev, port, pin)   | (1 << (pin))
+#define MM_LED_MASK     ((uint8_t)(0 MM_LED_PINS(MM_X_MASK)))
+#define MM_MOTOR_MASK   ((uint8_t)(0 MM_MOTOR_PINS(MM_X_MASK)))
+
+// number of motors, generated from pin map
+#define MM_X_COUNT(dev, port, pin)  + 1
+#define MM_NUM_MOTORS   (0 MM_MOTOR_PINS(MM_X_COUNT))
+
+// output shadows for port A (LEDs) and port B (motors on/off)
+extern uint8_t MM_OUT_A;
+extern uint8_t MM_OUT_B;
+// drive shadows, mixed into motor duties by the control loop
+extern MM_q15 MM_OUT_THROTTLE;
+extern MM_q15 MM_OUT_TURN;
+
+// Control loop timing, in units of MM_STAMP_US. Late is how long after
+// its tick a control step started, busy how long it ran for. Jitter is
+// the spread of late. Maxima are since the last MM_MCU_ctrlStats().
+typedef struct {
+    uint16_t steps;     // control steps run (wrapping)
+    uint16_t overruns;  // steps still running at the next tick (wrapping)
+    uint8_t late_min;
+    uint8_t late_max;
+    uint8_t busy_max;
+} MM_ctrl_stats;
+
+// Clock source. MM_CLK_HSE runs from a crystal on PA1/PA2 (OSCIN/OSCOUT)
+// at HSE_VALUE, 24MHz on the STM8S208, for 50% more headroom than the
+// internal HSI. If the crystal doesn't start, or fails later, the MCU 
+// falls back to HSI. The LED pin map must be moved off PA1 and PA2 to
+// use it. Flash needs 1 wait state above 16MHz, set by the WAITSTATE
+// option byte (OPT7). Boot stays on HSI until it is set, and sets it if
+// not, so the first boot after flashing a new part runs from HSI.
+#ifndef MM_CLK_HSE
+#define MM_CLK_HSE      0
+#endif
+
+// TIM1 (wheel encoder) count rate. Must divide every master clock.
+#define MM_TIM1_HZ      4000000UL
+
+// Motor PWM frequency
+#define MM_PWM_HZ       1000
+
+// Clock governor levels, fastest first for each source, X(level, HSI 
+// prescaler, CPU prescaler, master clock in Hz, TIM4 prescaler, TIM2 
+// prescaler). Timer reload values and UART register values are derived
+// from the master clock for every level (see MM_stm8s.c), so tick, PWM,
+// encoder and baud timing never change. The HSE levels can only divide
+// the CPU clock, the master clock and peripherals stay at HSE_VALUE.
+#define MM_CLOCKS(X) \
+    X(MM_CLK_FAST, CLK_PRESCALER_HSIDIV1, CLK_PRESCALER_CPUDIV1, HSI_VALUE, \
+      TIM4_PRESCALER_128, TIM2_PRESCALER_16) \
+    X(MM_CLK_SLOW, CLK_PRESCALER_HSIDIV4, CLK_PRESCALER_CPUDIV1, HSI_VALUE / 4, \
+      TIM4_PRESCALER_32, TIM2_PRESCALER_4) \
+    MM_HSE_CLOCKS(X)
+
+#if MM_CLK_HSE
+#define MM_HSE_CLOCKS(X) \
+    X(MM_CLK_HSE_FAST, CLK_PRESCALER_HSIDIV1, CLK_PRESCALER_CPUDIV1, HSE_VALUE, \
+      TIM4_PRESCALER_128, TIM2_PRESCALER_16) \
+    X(MM_CLK_HSE_SLOW, CLK_PRESCALER_HSIDIV1, CLK_PRESCALER_CPUDIV4, HSE_VALUE, \
+      TIM4_PRESCALER_128, TIM2_PRESCALER_16)
+#else
+#define MM_HSE_CLOCKS(X)
+#endif
+
+typedef enum {
+#define MM_X_CLOCK_ENUM(clk, hsidiv, cpudiv, fclk, tim4, tim2) clk,
+    MM_CLOCKS(MM_X_CLOCK_ENUM)
+#undef MM_X_CLOCK_ENUM
+    MM_NUM_CLOCKS
+} MM_clock;
+
+// Timer settings derived from a clock level. TIM4 counts per 1ms tick
+// (rounded, 24MHz gives 188 and a tick 0.3% long), TIM2 counts per PWM
+// period, and TIM1 prescaler. TIM4 and TIM2 prescaler values are powers
+// of 2.
+#define MM_TICK_COUNTS(fclk, tim4) \
+    ((uint16_t)((((uint32_t)(fclk) >> (tim4)) + 500) / 1000))
+#define MM_PWM_COUNTS(fclk, tim2) \
+    ((uint16_t)(((uint32_t)(fclk) >> (tim2)) / MM_PWM_HZ))
+#define MM_TIM1_PSC(fclk) \
+    ((uint16_t)((uint32_t)(fclk) / MM_TIM1_HZ - 1))
+
+// Clock drops to the slow level of its source once the motors have been
+// stopped, with no MM_MCU_clockBoost(), for this long in ms
+#define MM_CLK_SLOW_AFTER_MS    500
+
+// UART divider for a baud rate, rounded to nearest
+#define MM_UART_DIV(fclk, baud) \
+    (((uint32_t)(fclk) + ((uint32_t)(baud) / 2)) / (uint32_t)(baud))
+// BRR1 = DIV[11:4], BRR2 = DIV[15:12] DIV[3:0]
+#define MM_UART_BRR1(fclk, baud) \
+    ((uint8_t)(MM_UART_DIV(fclk, baud) >> 4))
+#define MM_UART_BRR2(fclk, baud) \
+    ((uint8_t)(((MM_UART_DIV(fclk, baud) >> 8) & 0xF0) | (MM_UART_DIV(fclk, baud) & 0x0F)))
+// 1 if actual baud rate is within 2% of requested
+#define MM_UART_BAUD_OK(fclk, baud) \
+    (((((uint32_t)(fclk) > MM_UART_DIV(fclk, baud) * (uint32_t)(baud)) ? \
+        ((uint32_t)(fclk) - MM_UART_DIV(fclk, baud) * (uint32_t)(baud)) : \
+        (MM_UART_DIV(fclk, baud) * (uint32_t)(baud) - (uint32_t)(fclk))) * 50) \
+     <= MM_UART_DIV(fclk, baud) * (uint32_t)(baud))
+// compile time check of a baud rate, fails to compile if error is over 2%
+#define MM_UART_BAUD_CHECK(name, fclk, baud) \
+    typedef char name[MM_UART_BAUD_OK(fclk, baud) ? 1 : -1]
+
+// precomputed baud rate register values, see MM_BAUD()
+typedef struct {
+    uint8_t brr1;
+    uint8_t brr2;
+} MM_baud;
+
+#define MM_BAUD(fclk, baud) \
+    { MM_UART_BRR1(fclk, baud), MM_UART_BRR2(fclk, baud) }
+
+// Supported UART baud rates, slowest first, X(arg, baud). 'arg' is passed
+// through to X, eg. a clock frequency. Register values for each are 
+// precomputed into a table by MM_stm8s.c.
+#define MM_BAUD_RATES(X, arg) \
+    X(arg, 1200) \
+    X(arg, 2400) \
+    X(arg, 4800) \
+    X(arg, 9600) \
+    X(arg, 19200) \
+    X(arg, 38400) \
+    X(arg, 57600) \
+    X(arg, 115200)
+
+typedef enum {
+#define MM_X_BAUD_ENUM(arg, baud) MM_BAUD_##baud,
+    MM_BAUD_RATES(MM_X_BAUD_ENUM, 0)
+#undef MM_X_BAUD_ENUM
+    MM_NUM_BAUDS
+} MM_baud_rate;
+
+// UART baud rates at startup
+#define MM_BT_BAUD      MM_BAUD_9600
+#define MM_T2S_BAUD     MM_BAUD_9600
+
+// size of each UART transmit queue. Must be a power of 2.
+#define MM_TXQ_SIZE 64
+
+// size of bluetooth recieve queue. Must be a power of 2.
+#define MM_RXQ_SIZE 32
+
+// Byte from app that cuts the motors straight from the UART1 RX interrupt,
+// once the first control frame has arrived (see MM_MCU_linkAlive()).
+// Latched in MM_ESTOP until MM_MCU_estopClear(). Always queued as well.
+#define MM_ESTOP_BYTE   0xEE
+
+// 1 while emergency stop is latched, set by UART1 RX ISR
+extern volatile uint8_t MM_ESTOP;
+
+// UART statistics. Counters wrap, so take differences between reports.
+typedef struct {
+    uint16_t rx_bytes;
+    uint16_t tx_bytes;
+    uint16_t overrun;
+    uint16_t framing;
+    uint16_t noise;
+} MM_uart_stats;
+
+// Link supervision: motors are stopped if no control frame arrives from
+// the app for this long, in ms. App must send frames faster than this.
+#ifndef MM_LINK_TIMEOUT_MS
+#define MM_LINK_TIMEOUT_MS  200
+#endif
+
+// 1 while bluetooth link is lost, set by tick ISR
+extern volatile uint8_t MM_LINK_LOST;
+
+// bluetooth UART statistics
+extern volatile MM_uart_stats MM_BT_STATS;
+
+// Interrupt priority plan, X(ITC irq, software priority level), applied
+// by MM_MCU_init(). Level 3 is highest. An ISR is only interrupted by a
+// higher level, so heavy speech traffic never delays a control byte.
+//  3: bluetooth RX (control bytes, e-stop), motor PWM edges, encoders,
+//     bluetooth wake-up, clock failure. All short, and a late one is a
+//     lost byte, PWM glitch or lost edge.
+//  2: system tick and control loop, auto wake-up.
+//  1: UART transmit queues, telemetry and speech.
+// Data shared across levels must be accessed in __critical sections.
+#define MM_IRQ_PRIORITIES(X) \
+    X(ITC_IRQ_CLK,          ITC_PRIORITYLEVEL_3) \
+    X(ITC_IRQ_UART1_RX,     ITC_PRIORITYLEVEL_3) \
+    X(ITC_IRQ_TIM2_OVF,     ITC_PRIORITYLEVEL_3) \
+    X(ITC_IRQ_TIM2_CAPCOM,  ITC_PRIORITYLEVEL_3) \
+    X(ITC_IRQ_TIM1_CAPCOM,  ITC_PRIORITYLEVEL_3) \
+    X(ITC_IRQ_PORTA,        ITC_PRIORITYLEVEL_3) \
+    X(ITC_IRQ_TIM4_OVF,     ITC_PRIORITYLEVEL_2) \
+    X(ITC_IRQ_AWU,          ITC_PRIORITYLEVEL_2) \
+    X(ITC_IRQ_UART1_TX,     ITC_PRIORITYLEVEL_1) \
+    X(ITC_IRQ_UART3_TX,     ITC_PRIORITYLEVEL_1)
+
+// 1 if the priority plan read back correctly at init, so ISRs will nest
+extern uint8_t MM_IRQ_PLAN_OK;
+
+// Interrupt sources whose latency (event to ISR entry) is measured from
+// their timer. Bluetooth RX can't be timed this way, its overrun count 
+// shows if it was ever held off longer than a byte.
+typedef enum {
+    MM_IRQ_LAT_TICK,        // TIM4 update
+    MM_IRQ_LAT_PWM,         // TIM2 update
+    MM_IRQ_LAT_ENCODER,     // TIM1 capture, with MM_ENCODER_TIM1
+    MM_NUM_IRQ_LAT
+} MM_irq_lat;
+
+// worst-case latency of each source since reset in microseconds, for 
+// reading in the simulator or debugger
+extern volatile uint16_t MM_IRQ_LATENCY[MM_NUM_IRQ_LAT];
+
+// Low power. MM_MCU_idle() sleeps (WFI) until the next interrupt. After
+// MM_IDLE_HALT_MS with no bluetooth activity and the motors stopped it 
+// drops to active-halt instead, woken by bluetooth activity, and by the
+// auto wake-up unit every MM_IDLE_AWU_MS. 0 disables active-halt.
+#ifndef MM_IDLE_HALT_MS
+#define MM_IDLE_HALT_MS     30000
+#endif
+#define MM_IDLE_AWU         AWU_TIMEBASE_512MS
+#define MM_IDLE_AWU_MS      512
+
+// Watchdog. The IWDG is armed at init and refreshed by the tick ISR only 
+// while every task below has checked in (MM_MCU_heartbeat()) within its
+// deadline, X(task, deadline in ms). A task is watched from its first 
+// check-in. On a miss the motors are stopped as if by e-stop, the miss
+// is saved to data EEPROM, and the IWDG resets the MCU.
+//  MAIN: main loop passes, and progress inside its long waits (module
+//        init polls, phrase characters). Covers the longest blocking
+//        call, a 500ms delay plus a phrase to the T2S queue.
+// MAIN is the only task for now; startup, phrase upload and steering all
+// run in the main loop. The control loop isn't watched as a task, as it
+// runs from the same tick ISR that ages the tasks. If the tick stops, 
+// nothing refreshes the IWDG and it resets the MCU by itself.
+#define MM_WDG_TASKS(X) \
+    X(MM_WDG_MAIN,  1500)
+
+typedef enum {
+#define MM_X_WDG_ENUM(task, ms) task,
+    MM_WDG_TASKS(MM_X_WDG_ENUM)
+#undef MM_X_WDG_ENUM
+    MM_NUM_WDG_TASKS
+} MM_wdg_task;
+
+// MM_WDG_LAST value when no deadline has been missed
+#define MM_WDG_NONE     0xFF
+
+// IWDG timeout in ms, 256 * 256 counts of LSI / 2 (64kHz). Refreshed by
+// the tick ISR, and while halted by each AWU wake-up. The AWU runs from 
+// the same LSI, so its period only has to be well inside this.
+#define MM_WDG_TIMEOUT_MS   1024
+
+// Deadline misses, as saved in data EEPROM: total (saturating) and the 
+// task that missed last, MM_WDG_NONE if never. Read at init, so they 
+// survive the reset they cause.
+extern uint8_t MM_WDG_MISSES;
+extern uint8_t MM_WDG_LAST;
+
+// Why the MCU last reset, from the reset status flags. The STM8 has no 
+// software reset instruction, an illegal opcode is the usual way to force
+// one. Debugger (SWIM) and EMC resets count as cold.
+typedef enum {
+    MM_RESET_COLD,      // power-on, brown-out or reset pin
+    MM_RESET_WATCHDOG,  // IWDG or WWDG
+    MM_RESET_SOFTWARE,  // illegal opcode
+} MM_reset_cause;
+
+// result of MM_MCU_recvByteUntil()
+typedef enum {
+    MM_RECV_OK,
+    MM_RECV_TIMEOUT,    // nothing arrived before deadline
+    MM_RECV_ERROR,      // byte damaged by framing error or overrun
+} MM_recv_status;
+
 void MM_MCU_init(void);
+uint16_t MM_MCU_getTicks(void);
+uint16_t MM_MCU_getStamp(void);
 void MM_MCU_delay(__IO uint32_t ms);
-void MM_MCU_sendByte(unsigned char byte, char* module);
+void MM_MCU_sendByte(char byte, char * module);
 char MM_MCU_recvByte(char * module);
-void MM_MCU_setLED(MM_led MM_LED_COLOUR, MM_led_state MM_STATE);
-void MM_MCU_setMotor(MM_motor MM_MOTOR, MM_motor_state MM_STATE);
+MM_recv_status MM_MCU_recvByteUntil(char * module, uint16_t deadline, 
+                                    char * byte);
+void MM_MCU_setBaud(char * module, MM_baud_rate rate);
+uint8_t MM_MCU_rxReady(char * module);
+uint16_t MM_MCU_rxStamp(char * module, uint16_t * tick);
+void MM_MCU_rxFlush(char * module);
+uint8_t MM_MCU_txFree(char * module);
+uint8_t MM_MCU_txPending(char * module);
+uint8_t MM_MCU_txIdle(char * module);
+uint16_t MM_MCU_ramFree(void);
+uint16_t MM_MCU_ramStatic(void);
+void MM_MCU_stackPaint(void);
+uint16_t MM_MCU_stackUnused(void);
+void MM_MCU_commitOutputs(void);
+void MM_MCU_ctrlStats(MM_ctrl_stats * stats);
+void MM_MCU_linkAlive(void);
+void MM_MCU_estopClear(void);
+void MM_MCU_idle(uint8_t halt_ok);
+uint16_t MM_MCU_cpuDuty(void);
+void MM_MCU_clockBoost(uint8_t on);
+MM_clock MM_MCU_getClock(void);
+void MM_MCU_heartbeat(MM_wdg_task task);
+MM_reset_cause MM_MCU_resetCause(void);
+
+/*
+ * Deadlines in system ticks for MM_MCU_recvByteUntil() and other timeouts.
+ * Compared by signed difference, so they survive the tick wrapping as 
+ * long as they are less than 32s away.
+ */
+static inline uint16_t MM_MCU_deadline(uint16_t ms) {
+    return MM_MCU_getTicks() + ms;
+}
+
+static inline uint8_t MM_MCU_expired(uint16_t deadline) {
+    return (int16_t)(MM_MCU_getTicks() - deadline) >= 0;
+}
+
+/*
+ * Turn an LED on or off. Only changes the output shadow, each case is a 
+ * single BSET/BRES.
+ */
+static inline void MM_MCU_setLED(MM_led MM_LED_COLOUR, MM_led_state MM_STATE) {
+    switch (MM_LED_COLOUR) {
+#define MM_X_LED(dev, port, pin) \
+        case dev: \
+            if (MM_STATE == MM_LED_ON) MM_OUT_HIGH(port, pin); \
+            else MM_OUT_LOW(port, pin); \
+            break;
+        MM_LED_PINS(MM_X_LED)
+#undef MM_X_LED
+    }
+}
+
+/*
+ * Turn a motor on or off. Only changes the output shadow.
+ */
+static inline void MM_MCU_setMotor(MM_motor MM_MOTOR, MM_motor_state MM_STATE) {
+    switch (MM_MOTOR) {
+#define MM_X_MOTOR(dev, port, pin) \
+        case dev: \
+            if (MM_STATE == MM_MOTOR_ON) MM_OUT_HIGH(port, pin); \
+            else MM_OUT_LOW(port, pin); \
+            break;
+        MM_MOTOR_PINS(MM_X_MOTOR)
+#undef MM_X_MOTOR
+    }
+}
+
+/*
+ * Set throttle and turn (> 0 is right) for the differential drive mix, 
+ * which the control loop applies to the motors that are on. Only changes
+ * the output shadows.
+ */
+static inline void MM_MCU_setDrive(MM_q15 throttle, MM_q15 turn) {
+    MM_OUT_THROTTLE = throttle;
+    MM_OUT_TURN = turn;
+}
+
+// Interrupt handlers. SDCC requires these be visible from the file 
+// containing main().
+INTERRUPT_HANDLER(AWU_IRQHandler, 1);
+#if MM_CLK_HSE
+INTERRUPT_HANDLER(CLK_IRQHandler, 2);
+#endif
+INTERRUPT_HANDLER(EXTI_PORTA_IRQHandler, 3);
+INTERRUPT_HANDLER(TIM1_CAP_COM_IRQHandler, 12);
+INTERRUPT_HANDLER(TIM2_UPD_OVF_BRK_IRQHandler, 13);
+INTERRUPT_HANDLER(TIM2_CAP_COM_IRQHandler, 14);
+INTERRUPT_HANDLER(UART1_TX_IRQHandler, 17);
+INTERRUPT_HANDLER(UART1_RX_IRQHandler, 18);
+INTERRUPT_HANDLER(UART3_TX_IRQHandler, 20);
+INTERRUPT_HANDLER(TIM4_UPD_OVF_IRQHandler, 23);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef MM_STORE_H
+#define MM_STORE_H
+
+#include <stdint.h>
+
+/**********************************************************************************
+ * @File     MM_store.h
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Wear-levelled key/value store in data EEPROM for the MiniMech
+ *           robot. See MM_store.c for details of operation.
+ **********************************************************************************/
+
+// longest stored value, in bytes
+#define MM_STORE_VAL_MAX    5
+
+// Stored values, as X(key, length in bytes). Keys are saved by position,
+// so only ever add to the end. Removed keys are dropped at compaction.
+#define MM_STORE_KEYS(X) \
+    X(MM_KEY_BT_BAUD,   1)  /* HC-06 baud rate (MM_baud_rate) */ \
+    X(MM_KEY_T2S_BAUD,  1)  /* T2S baud rate, MM_NUM_BAUDS if it failed */ \
+    X(MM_KEY_WDG,       2)  /* MM_WDG_MISSES, MM_WDG_LAST */ \
+    X(MM_KEY_RUN,       1)  /* how far the last run got, see MM_main.c */
+
+typedef enum {
+#define MM_X_KEY_ENUM(key, len) key,
+    MM_STORE_KEYS(MM_X_KEY_ENUM)
+#undef MM_X_KEY_ENUM
+    MM_NUM_KEYS
+} MM_store_key;
+
+// read the store back from data EEPROM. Called once from MM_MCU_init().
+void MM_STORE_init(void);
+// copy a key's value to val, returns 0 (val untouched) if never stored
+uint8_t MM_STORE_get(MM_store_key key, void * val);
+// store a key's value. Saved to data EEPROM by MM_STORE_poll().
+void MM_STORE_set(MM_store_key key, const void * val);
+// carry on saving and erasing in the background. Never waits.
+void MM_STORE_poll(void);
+// wait until everything set so far is saved, for values that must be in
+// data EEPROM before the next step. Main loop only.
+void MM_STORE_flush(void);
+// 1 while anything is left to save or erase
+uint8_t MM_STORE_busy(void);
+// store a value and wait until it is saved, from an ISR on the way to a
+// reset. Returns 0 if the ISR interrupted the store mid-change.
+uint8_t MM_STORE_setNow(MM_store_key key, const void * val);
+
+#endif
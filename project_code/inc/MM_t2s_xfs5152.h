@@ -12,8 +12,35 @@
 
 #include <stdint.h>
 #include <stm8s.h>
+#include <MM_stm8s.h>
 
-void MM_T2S_init(void);
+// Baud rate the module's BAUD0/BAUD1 pins are strapped for. MM_T2S_initPoll()
+// falls back to MM_T2S_BAUD if the module doesn't answer at this rate.
+#ifndef MM_T2S_BAUD_FAST
+#define MM_T2S_BAUD_FAST    MM_BAUD_115200
+#endif
+
+// timeout for module replies, in ms
+#define MM_T2S_TIMEOUT_MS   100
+
+// attempts at a command before the module is taken as lost
+#define MM_T2S_RETRIES      3
+
+// minimum time between status queries from MM_T2S_getStatus(), in ms
+#define MM_T2S_POLL_MS      50
+
+// passes over both rates before giving up, with backoff between passes 
+// doubling from MM_T2S_BACKOFF_MIN_MS
+#define MM_T2S_INIT_RETRIES     5
+#define MM_T2S_BACKOFF_MIN_MS   100
+
+// 1 while module is speaking, as last reported by module
+extern uint8_t MM_T2S_BUSY;
+// 1 once module has answered, 0 if it never did and speech is disabled
+extern uint8_t MM_T2S_READY;
+
+MM_init_status MM_T2S_initPoll(void);
+void MM_T2S_resume(void);
 void MM_T2S_sendPhrase(void);
 void MM_T2S_stopPhrase(void);
 uint8_t MM_T2S_getStatus(void);
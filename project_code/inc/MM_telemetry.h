@@ -0,0 +1,35 @@
+#ifndef MM_TELEMETRY_H
+#define MM_TELEMETRY_H
+
+#include <stdint.h>
+
+/**********************************************************************************
+ * @File     MM_telemetry.h
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Periodic runtime telemetry for the MiniMech robot. See 
+ *           MM_telemetry.c for details of operation.
+ **********************************************************************************/
+
+// default period between telemetry frames, in ms. 0 = disabled.
+#ifndef MM_TLM_PERIOD_MS
+#define MM_TLM_PERIOD_MS 1000
+#endif
+
+// telemetry frame sync bytes
+#define MM_TLM_SYNC_1 0xA5
+#define MM_TLM_SYNC_2 0x54
+
+// length of telemetry frame in bytes, including sync
+#define MM_TLM_FRAME_LEN 36
+
+// count one iteration of the main loop
+#define MM_TLM_LOOP() (MM_TLM_LOOPS++)
+extern uint16_t MM_TLM_LOOPS;
+
+// set period between telemetry frames, in ms. 0 disables telemetry.
+void MM_TLM_setPeriod(uint16_t period_ms);
+// send a telemetry frame if one is due. Never waits on the UART.
+void MM_TLM_poll(void);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef MM_TRACE_H
+#define MM_TRACE_H
+
+#include <stdint.h>
+
+/**********************************************************************************
+ * @File     MM_trace.h
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Event trace buffer for the MiniMech robot. See MM_trace.c for
+ *           details of operation.
+ **********************************************************************************
+ * Events are recorded into a ring buffer in RAM with the system tick they
+ * occured at, and can be dumped to the app via bluetooth. Use the MM_TRACE()
+ * macro to record an event, so tracing can be compiled out with 
+ * MM_TRACE_ENABLE = 0.
+ **********************************************************************************/
+
+// enabled by default, cheap enough to leave in production builds
+#ifndef MM_TRACE_ENABLE
+#define MM_TRACE_ENABLE 1
+#endif
+
+// number of records in trace ring. Must be a power of 2, max 128.
+#define MM_TRACE_SIZE 64
+
+// dump frame sync bytes, followed by record count then records
+#define MM_TRACE_SYNC_1 0xA5
+#define MM_TRACE_SYNC_2 0x5A
+
+// trace event ids (keep in step with tools/MM_trace_decode.py)
+typedef enum {
+    MM_TRC_STATE,       // FSM state change, arg = new state
+    MM_TRC_BT_RX,       // byte recieved from bluetooth module, arg = byte
+    MM_TRC_T2S_START,   // speech frame start, arg = phrase index
+    MM_TRC_T2S_END,     // speech frame end, arg = phrase index
+    MM_TRC_MOTOR,       // motor change, arg = (motor << 1) | state
+    MM_TRC_LINK,        // bluetooth link change, arg = 1 lost, 0 back
+    MM_TRC_HALT,        // active-halt, arg = 1 entered, 0 woken
+    MM_TRC_CLOCK,       // clock level change, arg = new level (MM_clock)
+    MM_TRC_BOOT,        // MCU init, arg = reset cause (MM_reset_cause)
+} MM_trace_event;
+
+// single trace record, 4 bytes
+typedef struct {
+    uint8_t event;
+    uint8_t arg;
+    uint16_t tick;
+} MM_trace_rec;
+
+#if MM_TRACE_ENABLE
+#define MM_TRACE(event, arg) MM_TRACE_log((event), (uint8_t)(arg))
+#else
+#define MM_TRACE(event, arg)
+#endif
+
+// record an event. Safe to call from interrupt handlers.
+void MM_TRACE_log(uint8_t event, uint8_t arg);
+// send contents of trace buffer to app, oldest record first
+void MM_TRACE_dump(void);
+
+#endif
@@ -5,6 +5,10 @@
 #include <stdint.h>
 #include <MM_bt_hc06.h>
 #include <MM_stm8s.h>
+#include <MM_trace.h>
+#include <MM_latency.h>
+#include <MM_telemetry.h>
+#include <MM_store.h>
 
 /*********************************************************************************
  * @File     MM_bt_hc06.h
@@ -18,50 +22,297 @@
  * MiniMech software.
  *********************************************************************************/
 
+// MM_BT_initPoll() states
+typedef enum {
+    BT_INIT_START,      // build list of rates to scan
+    BT_INIT_PROBE,      // send "AT" at next rate in scan list
+    BT_INIT_PROBE_WAIT, // wait for "OK"
+    BT_INIT_BAUD_WAIT,  // wait for "OK" reply to "AT+BAUDn"
+    BT_INIT_DRAIN,      // wait for rest of "AT+BAUDn" reply
+    BT_INIT_BACKOFF,    // scan failed, wait before scanning again
+    BT_INIT_DONE
+} MM_bt_init_state;
+
+static MM_bt_init_state MM_BT_INIT_STATE = BT_INIT_START;
+// rates to try, in order, and position in list
+static MM_baud_rate MM_BT_SCAN[MM_NUM_BAUDS];
+static uint8_t MM_BT_SCAN_LEN = 0;
+static uint8_t MM_BT_SCAN_IDX = 0;
+// rate cached in the store, MM_NUM_BAUDS if none
+static MM_baud_rate MM_BT_CACHED = MM_NUM_BAUDS;
+// switch to MM_BT_BAUD_FAST is only tried once
+static uint8_t MM_BT_NEGOTIATE = 1;
+// rest of reply expected from module
+static const char * MM_BT_REPLY;
+// start of current wait, and current backoff
+static uint16_t MM_BT_WAIT_START = 0;
+static uint16_t MM_BT_BACKOFF = MM_BT_BACKOFF_MIN_MS;
+
+/*
+ * Send a string to the module, without null terminator.
+ */
+static void MM_BT_sendStr(const char * str) {
+    while (*str) {
+        MM_MCU_sendByte(*str++, "BT");
+    }
+}
+
+/*
+ * Start waiting on a reply from the module.
+ */
+static void MM_BT_expect(const char * reply) {
+    MM_BT_REPLY = reply;
+    MM_BT_WAIT_START = MM_MCU_getTicks();
+}
+
+/*
+ * Check bytes recieved against expected reply. Returns 1 once the whole 
+ * reply has arrived, -1 on a wrong byte, 0 while still waiting.
+ */
+static int8_t MM_BT_matchReply(void) {
+    while (MM_MCU_rxReady("BT")) {
+        if (MM_MCU_recvByte("BT") != *MM_BT_REPLY) {
+            return -1;
+        }
+        if (*++MM_BT_REPLY == '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if ms have passed since start of current wait.
+ */
+static uint8_t MM_BT_waited(uint16_t ms) {
+    return (uint16_t)(MM_MCU_getTicks() - MM_BT_WAIT_START) >= ms;
+}
+
+/*
+ * Baud rate the module was last found at, from the store. Returns 
+ * MM_NUM_BAUDS if nothing valid is stored.
+ */
+static MM_baud_rate MM_BT_cachedBaud(void) {
+    uint8_t rate;
+    if (!MM_STORE_get(MM_KEY_BT_BAUD, &rate) || (rate >= MM_NUM_BAUDS)) {
+        return MM_NUM_BAUDS;
+    }
+    return (MM_baud_rate)rate;
+}
+
+static void MM_BT_cacheBaud(MM_baud_rate rate) {
+    uint8_t val = rate;
+    MM_STORE_set(MM_KEY_BT_BAUD, &val);
+}
+
+/*
+ * Add a rate to the scan list, if valid and not already there.
+ */
+static void MM_BT_scanAdd(MM_baud_rate rate) {
+    uint8_t n;
+    if (rate >= MM_NUM_BAUDS) {
+        return;
+    }
+    for (n = 0; n < MM_BT_SCAN_LEN; n++) {
+        if (MM_BT_SCAN[n] == rate) {
+            return;
+        }
+    }
+    MM_BT_SCAN[MM_BT_SCAN_LEN++] = rate;
+}
+
 /*
- * Connect to app via bluetooth. Returns 1 on success.
+ * The HC-06 keeps its rate over power cycles, so scan the cached rate 
+ * first, then the rates we set it to, then every other rate fastest first.
  */
-uint8_t MM_BT_init(void) {
-
-    // Use AT command to signal module is connected
-    char buf [2];
-    while ((buf[0] != 'O') || (buf[1] != 'K')) {
-        // send AT
-        MM_MCU_sendByte('A', "BT");
-        MM_MCU_sendByte('T', "BT");
-        // wait for OK
-        buf[0] = MM_MCU_recvByte("BT");
-        buf[1] = MM_MCU_recvByte("BT");
+static void MM_BT_scanBuild(void) {
+    int8_t rate;
+    MM_BT_SCAN_LEN = 0;
+    MM_BT_SCAN_IDX = 0;
+    MM_BT_scanAdd(MM_BT_CACHED);
+    MM_BT_scanAdd(MM_BT_BAUD_FAST);
+    MM_BT_scanAdd(MM_BT_BAUD);
+    for (rate = MM_NUM_BAUDS - 1; rate >= 0; rate--) {
+        MM_BT_scanAdd(rate);
     }
+}
+
+/*
+ * Module answered at MM_BT_SCAN[MM_BT_SCAN_IDX]. Switch it to 
+ * MM_BT_BAUD_FAST if not there already, otherwise finished.
+ */
+static void MM_BT_found(void) {
+    MM_baud_rate rate = MM_BT_SCAN[MM_BT_SCAN_IDX];
+    // HC-06 numbers its rates from 1 = 1200, same order as MM_baud_rate
+    char cmd[] = "AT+BAUDx";
+
+    if ((rate != MM_BT_BAUD_FAST) && MM_BT_NEGOTIATE) {
+        MM_BT_NEGOTIATE = 0;
+        cmd[7] = '1' + MM_BT_BAUD_FAST;
+        MM_BT_sendStr(cmd);
+        // reply is "OK<rate>", sent at the old rate
+        MM_BT_expect("OK");
+        MM_BT_INIT_STATE = BT_INIT_BAUD_WAIT;
+        return;
+    }
+    if (rate != MM_BT_CACHED) {
+        MM_BT_cacheBaud(rate);
+    }
+    MM_BT_INIT_STATE = BT_INIT_DONE;
+}
+
+/*
+ * Connect to bluetooth module, without blocking. Call repeatedly until it
+ * stops returning MM_INIT_BUSY.
+ * 
+ * Finds the module's baud rate by sending "AT" at each rate in the scan 
+ * list until it answers "OK", each with a short timeout. If it isn't at 
+ * MM_BT_BAUD_FAST, it is switched there once, staying at the found rate on
+ * failure. The rate in use is cached in the store so the next boot finds it 
+ * on the first try. Failed scans are retried with exponential backoff, 
+ * the robot can't run without bluetooth so this never gives up.
+ */
+MM_init_status MM_BT_initPoll(void) {
+    int8_t reply;
+
+    switch (MM_BT_INIT_STATE) {
+        case BT_INIT_START :
+            MM_BT_CACHED = MM_BT_cachedBaud();
+            MM_BT_scanBuild();
+            MM_BT_INIT_STATE = BT_INIT_PROBE;
+            break;
+        case BT_INIT_PROBE :
+            // don't change rate until last bytes have gone
+            if (!MM_MCU_txIdle("BT")) {
+                break;
+            }
+            MM_MCU_setBaud("BT", MM_BT_SCAN[MM_BT_SCAN_IDX]);
+            // discard anything left from a failed probe
+            while (MM_MCU_rxReady("BT")) {
+                MM_MCU_recvByte("BT");
+            }
+            MM_BT_sendStr("AT");
+            MM_BT_expect("OK");
+            MM_BT_INIT_STATE = BT_INIT_PROBE_WAIT;
+            break;
+        case BT_INIT_PROBE_WAIT :
+            reply = MM_BT_matchReply();
+            if (reply > 0) {
+                MM_BT_found();
+            }
+            else if ((reply < 0) || MM_BT_waited(MM_BT_AT_TIMEOUT_MS)) {
+                if (++MM_BT_SCAN_IDX < MM_BT_SCAN_LEN) {
+                    MM_BT_INIT_STATE = BT_INIT_PROBE;
+                }
+                else {
+                    MM_BT_WAIT_START = MM_MCU_getTicks();
+                    MM_BT_INIT_STATE = BT_INIT_BACKOFF;
+                }
+            }
+            break;
+        case BT_INIT_BAUD_WAIT :
+            reply = MM_BT_matchReply();
+            if (reply > 0) {
+                MM_BT_WAIT_START = MM_MCU_getTicks();
+                MM_BT_INIT_STATE = BT_INIT_DRAIN;
+            }
+            // module may be at either rate, so scan again
+            else if ((reply < 0) || MM_BT_waited(MM_BT_BAUD_TIMEOUT_MS)) {
+                MM_BT_INIT_STATE = BT_INIT_START;
+            }
+            break;
+        case BT_INIT_DRAIN :
+            if (MM_MCU_rxReady("BT")) {
+                MM_MCU_recvByte("BT");
+                MM_BT_WAIT_START = MM_MCU_getTicks();
+            }
+            // confirm module answers at new rate
+            else if (MM_BT_waited(MM_BT_QUIET_MS)) {
+                MM_BT_SCAN[0] = MM_BT_BAUD_FAST;
+                MM_BT_SCAN_LEN = 1;
+                MM_BT_SCAN_IDX = 0;
+                MM_BT_INIT_STATE = BT_INIT_PROBE;
+            }
+            break;
+        case BT_INIT_BACKOFF :
+            if (MM_BT_waited(MM_BT_BACKOFF)) {
+                if (MM_BT_BACKOFF < MM_BT_BACKOFF_MAX_MS) {
+                    MM_BT_BACKOFF <<= 1;
+                }
+                MM_BT_INIT_STATE = BT_INIT_START;
+            }
+            break;
+        case BT_INIT_DONE :
+            return MM_INIT_OK;
+    }
+    return MM_INIT_BUSY;
+}
+
+/*
+ * Pick up where the last run left off, after a watchdog or software reset
+ * of the MCU only. The module kept its power and rate, and may still be 
+ * connected to the app, where AT commands would go to the app instead.
+ * So the handshake is skipped and the UART set to the cached rate. 
+ * Returns 0 if no rate is cached, and MM_BT_initPoll() is needed.
+ */
+uint8_t MM_BT_resume(void) {
+    MM_BT_CACHED = MM_BT_cachedBaud();
+    if (MM_BT_CACHED == MM_NUM_BAUDS) {
+        return 0;
+    }
+    MM_MCU_setBaud("BT", MM_BT_CACHED);
+    MM_BT_INIT_STATE = BT_INIT_DONE;
     return 1;
 }
 
 /*
- * Get phrase from app via bluetooth. Returns 1 if a phrase has been acquired,
- * 0 when last phrase has been recieved, signaled by a phrase of "\0" from app.
- * 0 is then returned. Maximum phrase length = 280 chars.
+ * Get phrase from app via bluetooth, stored at MM_PHRASES[MM_PHR_INDEX].
+ * The last phrase is signaled by a phrase of "\0" from app. Maximum 
+ * phrase length = 249 chars.
+ * 
+ * Waits up to MM_BT_PHRASE_WAIT_MS for a phrase to start, then 
+ * MM_BT_CHAR_TIMEOUT_MS for each char. A phrase cut off by a timeout is 
+ * discarded, the app can't be asked to resend so the caller just tries 
+ * for the next one. Damaged chars are dropped.
  */
- uint8_t MM_BT_getPhrase(void) {
+MM_bt_phrase_status MM_BT_getPhrase(void) {
+
+    uint16_t char_idx = 0;
+    MM_recv_status status;
+    char buf;
+    // get 1st char
+    do {
+        status = MM_MCU_recvByteUntil("BT", 
+                     MM_MCU_deadline(MM_BT_PHRASE_WAIT_MS), &buf);
+        if (status == MM_RECV_TIMEOUT) {
+            return MM_BT_PHRASE_TIMEOUT;
+        }
+    } while (status != MM_RECV_OK);
 
-     uint16_t char_idx = 0;
-     // get 1st char
-     char buf = MM_MCU_recvByte("BT");
-     
     // check to see if this is signal for last phrase
     if (buf == '\0') {
-        return 0;
+        return MM_BT_PHRASE_LAST;
     }
 
     // put string into MM_PHRASES buffer
     while ((char_idx < 249) && (buf != '\0')) {
-         MM_PHRASES[MM_PHR_INDEX][char_idx] = buf;
-         buf = MM_MCU_recvByte("BT");
-         char_idx++;
+        // a long phrase can outlast the main loop's deadline
+        MM_MCU_heartbeat(MM_WDG_MAIN);
+        if (status == MM_RECV_OK) {
+            MM_PHRASES[MM_PHR_INDEX][char_idx] = buf;
+            char_idx++;
+        }
+        status = MM_MCU_recvByteUntil("BT", 
+                     MM_MCU_deadline(MM_BT_CHAR_TIMEOUT_MS), &buf);
+        if (status == MM_RECV_TIMEOUT) {
+            MM_PHRASES[MM_PHR_INDEX][0] = '\0';
+            return MM_BT_PHRASE_TIMEOUT;
+        }
     }
     //add null byte to string in MM_PHRASES buffer
     MM_PHRASES[MM_PHR_INDEX][char_idx] = '\0';
-    return 1;
- }
+    return MM_BT_PHRASE_OK;
+}
  
  /**
   * Acquires X, Y, Z values form accelerometer from app via bluetooth. 
@@ -70,14 +321,54 @@ uint8_t MM_BT_init(void) {
   *   Y-axis = forward/steer = 2rd LSB (1 = forward, 0 = steer)
   *   Z-axis = jerk downwards = LSB (1 = jerk, 0 = not jerked)
   * This data is used to set MM_CONTROL (located in MM_lib.h)
+  * Returns straight away if nothing has arrived, leaving MM_CONTROL as is.
+  * Damaged bytes are ignored, the app resends with the next reading.
   */
  void MM_BT_getXYZ(void) {
-    // get data
-    char data = MM_MCU_recvByte("BT");
+    char data;
+    uint16_t stamp;
+    uint16_t tick;
+    MM_controller_state prev_control = MM_CONTROL;
+
+    if (!MM_MCU_rxReady("BT")) {
+        return;
+    }
+    // arrival time, for latency measurement. Stamped by the RX interrupt,
+    // so time waiting in the queue counts.
+    stamp = MM_MCU_rxStamp("BT", &tick);
+    // get data, already arrived so no need to wait
+    if (MM_MCU_recvByteUntil("BT", MM_MCU_getTicks(), &data) != MM_RECV_OK) {
+        return;
+    }
+
+    // handle commands from app, these leave MM_CONTROL unchanged
+    if (data & MM_BT_CMD_FLAG) {
+        if (data == MM_BT_CMD_TRACE) {
+            MM_TRACE_dump();
+        }
+        else if (data == MM_BT_CMD_LATENCY) {
+            MM_LAT_report();
+        }
+        else if ((data & 0xF0) == MM_BT_CMD_TLM_RATE) {
+            MM_TLM_setPeriod((data & 0x0F) * 250);
+        }
+        // MM_BT_CMD_ESTOP has already stopped the motors, in the UART ISR
+        else if (data == MM_BT_CMD_RESUME) {
+            MM_MCU_estopClear();
+        }
+        return;
+    }
+    // only the 3 LSBs are used, anything else is noise
+    if (data & ~0x07) {
+        return;
+    }
+    // valid control frame, link is up
+    MM_MCU_linkAlive();
+
     // extract XYZ values
-    uint8_t x_val = data && (1 << 2);
-    uint8_t y_val = data && (1 << 1);
-    uint8_t z_val = data && 1;
+    uint8_t x_val = (data >> 2) & 1;
+    uint8_t y_val = (data >> 1) & 1;
+    uint8_t z_val = data & 1;
 
     // set MM_CONTROL (order is important)
     // switch in/out of speak mode
@@ -96,5 +387,10 @@ uint8_t MM_BT_init(void) {
     else {
         MM_CONTROL = MM_RIGHT;
     }
+
+    // new gesture, time until it reaches the motors
+    if (MM_CONTROL != prev_control) {
+        MM_LAT_frameIn(stamp, tick);
+    }
  }
 
@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <MM_fixed.h>
+
+/**********************************************************************************
+ * @File     MM_fixed.c
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Fixed-point maths for the MiniMech robot.
+ **********************************************************************************
+ * Avoids SDCC's software float library, which is large and slow on the
+ * STM8. The STM8 only has an 8x8 bit MUL, so Q15 multiplies are built
+ * from 8-bit partial products rather than calling the 32x32 bit library
+ * multiply. Overflow is detected from sign bits, which is cheaper than
+ * widening to 32 bits.
+ *
+ * Only what the control code uses is kept here. SDCC links whole object
+ * files, so anything else would cost flash whether called or not.
+ **********************************************************************************/
+
+/*
+ * Saturating Q15 add and subtract. Overflow happened if the result's sign
+ * differs from both inputs' (add) or from a's when a and b differ (sub).
+ */
+MM_q15 MM_FX_add15(MM_q15 a, MM_q15 b) {
+    MM_q15 r = (MM_q15)((uint16_t)a + (uint16_t)b);
+    if (((a ^ r) & (b ^ r)) < 0) {
+        return (a < 0) ? MM_Q15_MIN : MM_Q15_MAX;
+    }
+    return r;
+}
+
+MM_q15 MM_FX_sub15(MM_q15 a, MM_q15 b) {
+    MM_q15 r = (MM_q15)((uint16_t)a - (uint16_t)b);
+    if (((a ^ b) & (a ^ r)) < 0) {
+        return (a < 0) ? MM_Q15_MIN : MM_Q15_MAX;
+    }
+    return r;
+}
+
+/*
+ * Unsigned 16x16 bit multiply, top 17 bits of the 32-bit product after
+ * rounding at bit 15. Built from four 8x8 bit MULs.
+ */
+static uint16_t MM_FX_umul15(uint16_t a, uint16_t b) {
+    uint8_t al = (uint8_t)a;
+    uint8_t ah = (uint8_t)(a >> 8);
+    uint8_t bl = (uint8_t)b;
+    uint8_t bh = (uint8_t)(b >> 8);
+    uint16_t lo = (uint16_t)al * bl;
+    uint16_t hi = (uint16_t)ah * bh;
+    uint32_t mid = (uint32_t)((uint16_t)al * bh) + (uint16_t)((uint16_t)ah * bl);
+    // low 16 bits of product, plus rounding, carried into mid
+    mid += ((uint32_t)lo + (1 << 14)) >> 8;
+    // product >> 15 = (hi << 1) + (mid >> 7)
+    return (uint16_t)((hi << 1) + (uint16_t)(mid >> 7));
+}
+
+/*
+ * Rounded, saturating Q15 multiply. Only -1.0 * -1.0 can overflow.
+ */
+MM_q15 MM_FX_mul15(MM_q15 a, MM_q15 b) {
+    uint16_t ua = (a < 0) ? (uint16_t)-a : (uint16_t)a;
+    uint16_t ub = (b < 0) ? (uint16_t)-b : (uint16_t)b;
+    uint16_t r = MM_FX_umul15(ua, ub);
+
+    if ((a ^ b) < 0) {
+        // r <= 32768, which negates to MM_Q15_MIN
+        return (MM_q15)-r;
+    }
+    return (r > MM_Q15_MAX) ? MM_Q15_MAX : (MM_q15)r;
+}
+
+MM_q15 MM_FX_clamp15(MM_q15 x, MM_q15 lo, MM_q15 hi) {
+    if (x < lo) return lo;
+    if (x > hi) return hi;
+    return x;
+}
+
+/*
+ * Scale an integer by a Q15 fraction, eg. a PWM period by a duty.
+ * Negative fractions give 0, MM_Q15_MAX gives n.
+ */
+uint16_t MM_FX_scale15(MM_q15 x, uint16_t n) {
+    if (x <= 0) {
+        return 0;
+    }
+    if (x == MM_Q15_MAX) {
+        return n;
+    }
+    return MM_FX_umul15((uint16_t)x, n);
+}
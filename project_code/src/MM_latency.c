@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <MM_latency.h>
+#include <MM_stm8s.h>
+
+/**********************************************************************************
+ * @File     MM_latency.c
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Gesture-to-actuation latency measurement for the MiniMech robot.
+ **********************************************************************************
+ * A control frame from the app that changes MM_CONTROL is timestamped on 
+ * arrival. The next change to the motors, switching on or off or a new
+ * duty target, completes the measurement, and the sample (in units of
+ * MM_STAMP_US) goes into a log2 bucketed histogram.
+ * A newer gesture arriving before actuation restarts the measurement, and
+ * one that hasn't reached the motors within MM_LAT_EXPIRE_MS of arriving
+ * is dropped, so a later unrelated output change (eg. a link loss stop) 
+ * isn't counted. Samples are 16-bit stamps, so one older than half their
+ * range could have wrapped, and is dropped too.
+ * 
+ * Report format (sent to app via bluetooth, 16-bit values MSB first):
+ *  0xA5 0x4C -> sync bytes
+ *  count, min, max, p50, p99 -> 16-bit each
+ *  MM_LAT_BUCKETS bucket counts -> 16-bit each
+ * 
+ * Percentiles are the upper bound of the bucket they fall in (clamped to
+ * max), so are accurate to within a factor of 2.
+ *
+ * Actuation happens in the MCU library's control loop, from an ISR, so
+ * the main loop blocks interrupts to start a measurement and reports from
+ * a copy of the statistics.
+ **********************************************************************************/
+
+typedef struct {
+    uint16_t hist[MM_LAT_BUCKETS];
+    uint16_t count;
+    uint16_t min;
+    uint16_t max;
+} MM_lat_stats;
+
+static MM_lat_stats MM_LAT = { { 0 }, 0, 0xFFFF, 0 };
+// timestamp of pending control frame, and tick it arrived at
+static uint16_t MM_LAT_START = 0;
+static uint16_t MM_LAT_START_TICK = 0;
+static uint8_t MM_LAT_PENDING = 0;
+
+// half the stamp range in ms, and the oldest sample kept. Ticks count 
+// whole ms, so allow for the part of one.
+#define MM_LAT_WRAP_MS      ((uint16_t)(0x8000UL * MM_STAMP_US / 1000))
+#define MM_LAT_MAX_AGE_MS   (((MM_LAT_EXPIRE_MS < MM_LAT_WRAP_MS) ? \
+                              MM_LAT_EXPIRE_MS : MM_LAT_WRAP_MS) - 1)
+
+/*
+ * Bit length of a sample, ie its histogram bucket.
+ */
+static uint8_t MM_LAT_bucket(uint16_t sample) {
+    uint8_t n = 0;
+    while (sample) {
+        sample >>= 1;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Value below which 'pct' percent of samples lie.
+ */
+static uint16_t MM_LAT_percentile(const MM_lat_stats * stats, uint8_t pct) {
+    uint32_t target = ((uint32_t)stats->count * pct + 99) / 100;
+    uint32_t total = 0;
+    uint8_t n;
+    for (n = 0; n < MM_LAT_BUCKETS; n++) {
+        total += stats->hist[n];
+        if (total >= target) {
+            break;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    // top of bucket n, clamped to largest value seen
+    if ((n >= 16) || (((1UL << n) - 1) > stats->max)) {
+        return stats->max;
+    }
+    return (uint16_t)((1UL << n) - 1);
+}
+
+static void MM_LAT_send16(uint16_t val) {
+    MM_MCU_sendByte(val >> 8, "BT");
+    MM_MCU_sendByte(val & 0xFF, "BT");
+}
+
+void MM_LAT_frameIn(uint16_t stamp, uint16_t tick) {
+    __critical {
+        MM_LAT_START = stamp;
+        MM_LAT_START_TICK = tick;
+        MM_LAT_PENDING = 1;
+    }
+}
+
+void MM_LAT_actuated(void) {
+    uint16_t sample;
+    if (!MM_LAT_PENDING) {
+        return;
+    }
+    MM_LAT_PENDING = 0;
+    if ((uint16_t)(MM_MCU_getTicks() - MM_LAT_START_TICK) >= 
+        MM_LAT_MAX_AGE_MS) {
+        return;
+    }
+    sample = MM_MCU_getStamp() - MM_LAT_START;
+
+    if (sample < MM_LAT.min) {
+        MM_LAT.min = sample;
+    }
+    if (sample > MM_LAT.max) {
+        MM_LAT.max = sample;
+    }
+    // counts saturate rather than wrap
+    if (MM_LAT.count != 0xFFFF) {
+        MM_LAT.count++;
+        MM_LAT.hist[MM_LAT_bucket(sample)]++;
+    }
+}
+
+void MM_LAT_report(void) {
+    MM_lat_stats stats;
+    uint8_t n;
+
+    __critical {
+        stats = MM_LAT;
+    }
+    MM_MCU_sendByte(MM_LAT_SYNC_1, "BT");
+    MM_MCU_sendByte(MM_LAT_SYNC_2, "BT");
+    MM_LAT_send16(stats.count);
+    MM_LAT_send16(stats.count ? stats.min : 0);
+    MM_LAT_send16(stats.max);
+    MM_LAT_send16(MM_LAT_percentile(&stats, 50));
+    MM_LAT_send16(MM_LAT_percentile(&stats, 99));
+    for (n = 0; n < MM_LAT_BUCKETS; n++) {
+        MM_LAT_send16(stats.hist[n]);
+    }
+}
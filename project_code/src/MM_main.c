@@ -14,7 +14,8 @@
  *  4) control over 4 LEDs (via 4/6 GPIO pins)
  *  5) control over 2 motors (via 2/6 GPIO pins)
  * 
- *  UART specifications: BAUD = 9600, 8-N-1 format
+ *  UART specifications: BAUD = 9600 at startup, 8-N-1 format. Modules are
+ *  switched to a faster rate by their init functions where supported.
  * 
  * The software contained in this file requires hardware functions that must 
  * be supplied by purpose-built MiniMech libraries for each module. Each of 
@@ -27,15 +28,25 @@
  *       // MCU to operate. 
  *       void MM_MCU_init(void);
  * 
+ *      // why the MCU last reset. Anything but MM_RESET_COLD may resume
+ *      // the last run rather than start again.
+ *      MM_reset_cause MM_MCU_resetCause(void);
+ * 
  *      // Standard Delay, max value required: 1000ms
  *      void MM_MCU_delay(__IO uint32_t ms);
  * 
  *      // send a single byte over UART. module = "BT" or "T2S"
  *      void MM_MCU_sendByte(char byte, char * module);
  * 
- *      // recieve a single byte from UART (stored at byte). 
+ *      // drop bytes recieved from UART but not yet read.
+ *      // module = "BT" or "T2S"
+ *      void MM_MCU_rxFlush(char * module);
+ * 
+ *      // recieve a single byte from UART (stored at byte), waiting until
+ *      // deadline (in ms ticks, from MM_MCU_deadline(ms)) at most.
  *      // module = "BT" or "T2S"
- *      char MM_MCU_recvByte(char* module);
+ *      MM_recv_status MM_MCU_recvByteUntil(char* module, uint16_t deadline,
+ *                                          char* byte);
  * 
  *      // turn LED on or off (arg types declared in MM_lib.h)
  *      void MM_MCU_setLED(MM_led MM_LED_COLOUR, MM_led_state MM_STATE);
@@ -43,17 +54,50 @@
  *      // turn motor on or off (arg types declared in MM_lib.h)
  *      void MM_MCU_motor(MM_motor MM_MOTOR, MM_motor_state MM_STATE);
  * 
+ *      // set differential drive as Q15 fractions of full (MM_fixed.h), 
+ *      // turn > 0 is right. Mixed into duties for the motors that are on.
+ *      void MM_MCU_setDrive(MM_q15 throttle, MM_q15 turn);
+ * 
+ *      // LED and motor changes only take effect when committed. Called
+ *      // once at the end of each FSM tick. The MCU library applies them 
+ *      // from its own fixed-rate control loop (MM_CTRL_HZ, MM_lib.h).
+ *      void MM_MCU_commitOutputs(void);
+ * 
+ *      // valid control frame recieved. If none arrives for 
+ *      // MM_LINK_TIMEOUT_MS the MCU library stops the motors itself, 
+ *      // independent of the main loop, until the link is back.
+ *      void MM_MCU_linkAlive(void);
+ * 
+ *      // nothing to do until the next event. Sleeps until an interrupt, 
+ *      // or if 'halt_ok' and idle for a while, in a deeper low power 
+ *      // mode until bluetooth activity.
+ *      void MM_MCU_idle(uint8_t halt_ok);
+ * 
+ *      // run at full speed for a burst of work (on = 1) until the matching
+ *      // call with on = 0. The MCU library may slow its clock otherwise.
+ *      void MM_MCU_clockBoost(uint8_t on);
+ * 
+ *      // watched task is alive (MM_WDG_TASKS). Each must check in within
+ *      // its deadline, or the MCU library stops the motors and resets.
+ *      void MM_MCU_heartbeat(MM_wdg_task task);
+ * 
  * Bluetooth functions:
- *      // initialise and connect with bluetooth module. Return 1 on success.
- *      uint8_t MM_BT_init(void);
+ *      // initialise and connect with bluetooth module without blocking. 
+ *      // Called repeatedly until it returns MM_INIT_OK (MM_lib.h).
+ *      MM_init_status MM_BT_initPoll(void);
+ * 
+ *      // after a warm reset, take the module as connected at its last
+ *      // rate without a handshake. Returns 0 if that isn't known.
+ *      uint8_t MM_BT_resume(void);
  * 
  *      // Get a phrase from bluetooth module, store it in 
  *      // MM_PHRASES[MM_PHR_INDEX]. Max return length = 249 chars. Returns 
- *      // 1 on success. Returns 0 if there are no more phrases to get.
- *      uint8_t MM_BT_getPhrase(void);
+ *      // MM_BT_PHRASE_OK on success, MM_BT_PHRASE_LAST if there are no 
+ *      // more phrases to get, MM_BT_PHRASE_TIMEOUT if none arrived in time.
+ *      MM_bt_phrase_status MM_BT_getPhrase(void);
  * 
  *      // recieve XYZ values via bluetooth and update MM_CONTROL variable
- *      // accordingly. XYZ values are sent from MiniMech phone app in a 
+ *      // accordingly, if a value has arrived. XYZ values are sent from MiniMech phone app in a 
  *      // single byte with the following format:
  *      //                      MSB  00000XYZ  LSB
  *      // Control flow:
@@ -63,9 +107,25 @@
  *      // else if (y == 1) MM_CONTORL =MM_RIGHT;
  *      void MM_BT_getXYZ();
  * 
+ * Store functions (MM_store.h), for values kept over resets:
+ *      // copy a key's value to val, returns 0 if never stored
+ *      uint8_t MM_STORE_get(MM_store_key key, void * val);
+ * 
+ *      // store a key's value, saved in the background by MM_MCU_idle()
+ *      void MM_STORE_set(MM_store_key key, const void * val);
+ *
+ *      // wait until everything set so far is saved
+ *      void MM_STORE_flush(void);
+ * 
  * Text-to-Speech functions:
- *      // initialise and connect to module. Return 1 on success.
- *      uint8_t MM_T2S_init();
+ *      // initialise and connect to module without blocking. Called 
+ *      // repeatedly alongside MM_BT_initPoll() until it returns MM_INIT_OK, 
+ *      // or MM_INIT_FAIL in which case the robot runs without speech.
+ *      MM_init_status MM_T2S_initPoll(void);
+ * 
+ *      // after a warm reset, take the module as ready or failed as it 
+ *      // was last run, without a handshake
+ *      void MM_T2S_resume(void);
  * 
  *      // send phrase to module, wait till phrase is finished
  *      void MM_T2S_sendPhrase(char* phrase);
@@ -92,10 +152,10 @@
 #include <MM_bt_hc06.h>
 #include <MM_stm8s.h>
 #include <MM_t2s_xfs5152.h>
-
-// flag to enable phrase to be sent once per SPEAK state
-uint8_t MM_speak_flag = 0;
-
+#include <MM_trace.h>
+#include <MM_telemetry.h>
+#include <MM_fixed.h>
+#include <MM_store.h>
 
 void MM_state_machine(void);
 // Required for compiler. Defined in MM_lib.c
@@ -108,131 +168,278 @@ typedef enum {
     STEER,
     MOVE,
     SPEAK,
+    NUM_STATES
 } _state;
 
+// number of MM_CONTROL values, for transition table
+#define NUM_CONTROLS (MM_SWITCH + 1)
+
 // Main state variable of machine
 _state STATE = STARTUP;
 
-// FSM for MiniMech
-void MM_state_machine(void) {
-    
-    switch (STATE) {
-        // configure MCU, init bluetooth and T2S modules
-        case STARTUP :
-            // set control to static (only used in STARTUP state)
-            MM_CONTROL = MM_STATIC;
-            // initalise MCU
-            MM_MCU_init();
-            // state LED config
-            MM_MCU_setLED(MM_LED_RED, MM_LED_ON);
-            // initialise BT and T2S modules
-            MM_BT_init();
-            MM_T2S_init();
-            // exit state
-            STATE = PHRASE;
-            // state LED deconfig
-            MM_MCU_setLED(MM_LED_RED, MM_LED_OFF);
-            break;
-        case PHRASE :
-            // state LED config
-            MM_MCU_setLED(MM_LED_RED, MM_LED_ON);
-            MM_MCU_setLED(MM_LED_ORANGE, MM_LED_ON);
-            // get phrases
-            MM_PHR_INDEX = 0;
-            while(((MM_PHR_INDEX < 10) && MM_BT_getPhrase())) {
+// MM_KEY_RUN once a run has got as far as STEER. A watchdog or software 
+// reset after that resumes in STEER, see MM_resume().
+#define MM_RUN_STEER    0xA5
+
+// Motor mixing in Q15. Steering pivots on one wheel, as motors can't
+// reverse: throttle - turn = 0 for the inside wheel.
+#define MM_THROTTLE_MOVE    MM_Q15(1.0)
+#define MM_THROTTLE_STEER   MM_Q15(0.5)
+#define MM_TURN_STEER       MM_Q15(0.5)
+
+/*
+ * Drive both motors, turn > 0 is right. The MCU library's control loop 
+ * does the mixing, a wheel mixed to 0 or less stops.
+ */
+static void MM_drive(MM_q15 throttle, MM_q15 turn) {
+    MM_MCU_setDrive(throttle, turn);
+    MM_MCU_setMotor(MM_MOTOR_L, MM_MOTOR_ON);
+    MM_MCU_setMotor(MM_MOTOR_R, MM_MOTOR_ON);
+}
+
+/*
+ * State handlers. Entry and exit run once per transition, tick runs on 
+ * every FSM call that the transition table doesn't move the FSM on. Tick 
+ * returns the next state (its own state to stay). Guard is checked before
+ * entering the state, which is skipped if it returns 0. Any may be NULL.
+ */
+typedef struct {
+    uint8_t (*guard)(void);
+    void (*entry)(void);
+    _state (*tick)(void);
+    void (*exit)(void);
+} MM_state_handlers;
+
+// record how far this run has got, for MM_resume()
+static void MM_setRun(uint8_t run) {
+    MM_STORE_set(MM_KEY_RUN, &run);
+}
+
+/*
+ * Fast boot. After a watchdog or software reset from STEER or beyond, the
+ * modules kept their power and settings and the app is still sending
+ * control bytes, so skip the handshakes and phrases and go straight back
+ * to STEER. Phrases were in RAM and are lost, so the robot carries on
+ * without speech. Only a cold reset takes the full path.
+ */
+static uint8_t MM_resume(void) {
+    uint8_t run = 0;
+
+    MM_STORE_get(MM_KEY_RUN, &run);
+    if ((MM_MCU_resetCause() == MM_RESET_COLD) || (run != MM_RUN_STEER) ||
+        !MM_BT_resume()) {
+        return 0;
+    }
+    MM_T2S_resume();
+    return 1;
+}
+
+// configure MCU, init bluetooth and T2S modules
+static _state MM_startup_tick(void) {
+    MM_init_status bt, t2s;
+
+    // set control to static (only used in STARTUP state)
+    MM_CONTROL = MM_STATIC;
+    // initalise MCU
+    MM_MCU_init();
+    if (MM_resume()) {
+        return STEER;
+    }
+    // full start, which has to reach STEER again before it can resume. 
+    // Saved straight away, as a reset during the module handshakes must
+    // not resume with modules that weren't set up this time.
+    MM_setRun(0);
+    MM_STORE_flush();
+    // state LED config, shown while waiting on modules
+    MM_MCU_setLED(MM_LED_RED, MM_LED_ON);
+    MM_MCU_commitOutputs();
+    // initialise BT and T2S modules side by side, so a slow or missing 
+    // module doesn't hold up the other
+    do {
+        MM_MCU_heartbeat(MM_WDG_MAIN);
+        bt = MM_BT_initPoll();
+        t2s = MM_T2S_initPoll();
+    } while ((bt == MM_INIT_BUSY) || (t2s == MM_INIT_BUSY));
+    // carry on without speech if T2S failed, see MM_speak_guard()
+    return PHRASE;
+}
+
+static void MM_startup_exit(void) {
+    MM_MCU_setLED(MM_LED_RED, MM_LED_OFF);
+}
+
+static void MM_phrase_entry(void) {
+    // phrases arrive back to back, frame them at full speed
+    MM_MCU_clockBoost(1);
+    MM_PHR_INDEX = 0;
+    MM_MCU_setLED(MM_LED_RED, MM_LED_ON);
+    MM_MCU_setLED(MM_LED_ORANGE, MM_LED_ON);
+}
+
+// get phrases from app. On a timeout come back next tick for the rest, 
+// so the main loop keeps running while the app connects.
+static _state MM_phrase_tick(void) {
+    while (MM_PHR_INDEX < 10) {
+        switch (MM_BT_getPhrase()) {
+            case MM_BT_PHRASE_OK :
                 MM_PHR_INDEX++;
                 MM_NUM_PHRASES++;
-            }
-            // state LED deconfig
-            MM_MCU_setLED(MM_LED_RED, MM_LED_OFF);
-            MM_MCU_setLED(MM_LED_ORANGE, MM_LED_OFF);
-            STATE = STEER;
-            break;
-        case STEER :
-            // switch states if necessary
-            if (MM_CONTROL == MM_SWITCH) {
-                STATE = SPEAK;
-                MM_MCU_setLED(MM_LED_ORANGE, MM_LED_OFF);
-                break;
-            }
-            if (MM_CONTROL == MM_FORWARD) {
-                STATE = MOVE;
-                MM_MCU_setLED(MM_LED_ORANGE, MM_LED_OFF);
                 break;
-            }
-            // steer mode actions
-            // state LED config
-            MM_MCU_setLED(MM_LED_ORANGE, MM_LED_ON);
-            // steer left
-            if (MM_CONTROL == MM_LEFT) {
-                MM_MCU_setMotor(MM_MOTOR_L, MM_MOTOR_OFF);
-                MM_MCU_setMotor(MM_MOTOR_R, MM_MOTOR_ON);    
-            }
-            // steer right
-            if (MM_CONTROL == MM_RIGHT) {
-                MM_MCU_setMotor(MM_MOTOR_L, MM_MOTOR_ON);
-                MM_MCU_setMotor(MM_MOTOR_R, MM_MOTOR_OFF);    
-            }
-            break;
-        case MOVE :
-            // switch states if necessary
-            if (MM_CONTROL == MM_SWITCH) {
-                STATE = SPEAK;
-                MM_MCU_setLED(MM_LED_GREEN, MM_LED_OFF);
-                break;
-            }
-            if ((MM_CONTROL == MM_LEFT) || (MM_CONTROL == MM_RIGHT)) {
-                STATE = STEER;
-                MM_MCU_setLED(MM_LED_GREEN, MM_LED_OFF);
-                break;
-            }        
-            // move mode actions
-            // state LED config
-            MM_MCU_setLED(MM_LED_GREEN, MM_LED_ON);
-            // move forward
-            MM_MCU_setMotor(MM_MOTOR_L, MM_MOTOR_ON);
-            MM_MCU_setMotor(MM_MOTOR_R, MM_MOTOR_ON);    
-            break;    
-        case SPEAK :
-            // ensure switch setting is not triggered by same movement
-            MM_MCU_delay(500);
-            // switch states if necessary
-            if (MM_CONTROL == MM_SWITCH) {
-                MM_T2S_stopPhrase();
-                STATE = STEER;
-                //reset flag on exit
-                MM_speak_flag = 0;
-                MM_MCU_setLED(MM_LED_BLUE, MM_LED_OFF);
-                break;
-            }
-            // speak mode actions
-            MM_MCU_setLED(MM_LED_BLUE, MM_LED_ON);
-            // tell text to speech module to say a random phrase
-            MM_MCU_delay(500);
-            // prevent phrase being resent until next time
-            // SPEAK state is entered
-            if (MM_speak_flag == 0) {
-                MM_T2S_sendPhrase();
-                MM_speak_flag = 1;
-            }
-            // checks if phrase has finished
-            if(!MM_T2S_getStatus()) {
-                STATE = STEER;
-                //reset flag on exit
-                MM_speak_flag = 0;
-            }
-            MM_MCU_setLED(MM_LED_BLUE, MM_LED_OFF);
-            break;    
+            case MM_BT_PHRASE_LAST :
+                return STEER;
+            default :
+                return PHRASE;
+        }
+    }
+    return STEER;
+}
+
+static void MM_phrase_exit(void) {
+    MM_MCU_clockBoost(0);
+    MM_MCU_setLED(MM_LED_RED, MM_LED_OFF);
+    MM_MCU_setLED(MM_LED_ORANGE, MM_LED_OFF);
+}
+
+static void MM_steer_entry(void) {
+    MM_MCU_setLED(MM_LED_ORANGE, MM_LED_ON);
+    // only saved once per run, as the store skips unchanged values
+    MM_setRun(MM_RUN_STEER);
+}
+
+static _state MM_steer_tick(void) {
+    // steer left
+    if (MM_CONTROL == MM_LEFT) {
+        MM_drive(MM_THROTTLE_STEER, -MM_TURN_STEER);
+    }
+    // steer right
+    if (MM_CONTROL == MM_RIGHT) {
+        MM_drive(MM_THROTTLE_STEER, MM_TURN_STEER);
+    }
+    return STEER;
+}
+
+static void MM_steer_exit(void) {
+    MM_MCU_setLED(MM_LED_ORANGE, MM_LED_OFF);
+}
+
+// move forward
+static void MM_move_entry(void) {
+    MM_MCU_setLED(MM_LED_GREEN, MM_LED_ON);
+    MM_drive(MM_THROTTLE_MOVE, 0);
+}
+
+static void MM_move_exit(void) {
+    MM_MCU_setLED(MM_LED_GREEN, MM_LED_OFF);
+}
+
+// tell text to speech module to say a phrase
+static void MM_speak_entry(void) {
+    MM_MCU_setLED(MM_LED_BLUE, MM_LED_ON);
+    MM_MCU_commitOutputs();
+    // ensure switch setting is not triggered by same movement. Frames 
+    // queued meanwhile are from that movement too, so are dropped, and 
+    // the switch that got here is used up.
+    MM_MCU_delay(500);
+    MM_MCU_rxFlush("BT");
+    MM_CONTROL = MM_STATIC;
+    MM_T2S_sendPhrase();
+}
+
+static _state MM_speak_tick(void) {
+    // checks if phrase has finished
+    if(!MM_T2S_getStatus()) {
+        return STEER;
+    }
+    return SPEAK;
+}
+
+// only speak if T2S module answered at startup, and there are phrases 
+// (none after a fast boot)
+static uint8_t MM_speak_guard(void) {
+    return MM_T2S_READY && MM_NUM_PHRASES;
+}
+
+static void MM_speak_exit(void) {
+    // switched out before phrase finished
+    if (MM_T2S_BUSY) {
+        MM_T2S_stopPhrase();
+    }
+    MM_MCU_setLED(MM_LED_BLUE, MM_LED_OFF);
+}
+
+static const MM_state_handlers MM_STATE_HANDLERS[NUM_STATES] = {
+    /*            guard           entry              tick               exit */
+    /* STARTUP */ { NULL,           NULL,              MM_startup_tick,   MM_startup_exit },
+    /* PHRASE  */ { NULL,           MM_phrase_entry,   MM_phrase_tick,    MM_phrase_exit },
+    /* STEER   */ { NULL,           MM_steer_entry,    MM_steer_tick,     MM_steer_exit },
+    /* MOVE    */ { NULL,           MM_move_entry,     NULL,              MM_move_exit },
+    /* SPEAK   */ { MM_speak_guard, MM_speak_entry,    MM_speak_tick,     MM_speak_exit },
+};
+
+/*
+ * Transitions on MM_CONTROL, checked before the state's tick handler.
+ * STARTUP and PHRASE move on from their tick handlers only.
+ */
+static const uint8_t MM_TRANSITIONS[NUM_STATES][NUM_CONTROLS] = {
+    /*             STATIC   FORWARD  LEFT     RIGHT    SWITCH */
+    /* STARTUP */ { STARTUP, STARTUP, STARTUP, STARTUP, STARTUP },
+    /* PHRASE  */ { PHRASE,  PHRASE,  PHRASE,  PHRASE,  PHRASE },
+    /* STEER   */ { STEER,   MOVE,    STEER,   STEER,   SPEAK },
+    /* MOVE    */ { MOVE,    MOVE,    STEER,   STEER,   SPEAK },
+    /* SPEAK   */ { SPEAK,   SPEAK,   SPEAK,   SPEAK,   STEER },
+};
+
+// FSM for MiniMech
+void MM_state_machine(void) {
+    const MM_state_handlers * handlers = &MM_STATE_HANDLERS[STATE];
+    _state next = MM_TRANSITIONS[STATE][MM_CONTROL];
+
+    if ((next == STATE) && handlers->tick) {
+        next = handlers->tick();
     }
 
+    // next state not available, eg. SPEAK without T2S module
+    if (MM_STATE_HANDLERS[next].guard && !MM_STATE_HANDLERS[next].guard()) {
+        next = STATE;
+    }
+
+    if (next != STATE) {
+        if (handlers->exit) {
+            handlers->exit();
+        }
+        STATE = next;
+        handlers = &MM_STATE_HANDLERS[STATE];
+        if (handlers->entry) {
+            handlers->entry();
+        }
+        MM_TRACE(MM_TRC_STATE, STATE);
+    }
+
+    // write LED and motor changes made this tick
+    MM_MCU_commitOutputs();
 }
 
 int main() {
     
+    // must come first, for stack high-water mark reporting
+    MM_MCU_stackPaint();
+
     while(1) {
+        MM_MCU_heartbeat(MM_WDG_MAIN);
         MM_state_machine();
-        //get bluetooth value that sets MM_CONTROL value
-        MM_BT_getXYZ();
+        //get bluetooth value that sets MM_CONTROL value, once app has 
+        // finished sending phrases
+        if (STATE > PHRASE) {
+            MM_BT_getXYZ();
+        }
+        // runtime telemetry to app
+        MM_TLM_LOOP();
+        MM_TLM_poll();
+        // sleep until something happens. Only halt while steering, where
+        // the robot sits waiting for input from the app.
+        if (!MM_MCU_rxReady("BT")) {
+            MM_MCU_idle(STATE == STEER);
+        }
     } 
     return 0;
 }
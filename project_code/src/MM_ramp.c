@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <MM_ramp.h>
+
+/**********************************************************************************
+ * @File     MM_ramp.c
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Ramp generator for motor duty on the MiniMech robot.
+ **********************************************************************************
+ * Each ramp moves its value towards its target by at most cfg->up or
+ * cfg->down per tick (one control period, MM_CTRL_PERIOD_MS). This is a 
+ * linear ramp, with a step change in rate at each end.
+ *
+ * With cfg->accel set the ramp is jerk limited. The rate itself changes by
+ * at most cfg->accel per tick, so the value follows an S-curve. The ramp
+ * starts braking once the distance it would cover while slowing down,
+ * about rate^2 / (2 * accel), reaches the distance left to the target.
+ * A new target part way through a ramp is followed smoothly, including
+ * slowing down before reversing.
+ *
+ * Ticked from the control loop in the system tick ISR, so all state 
+ * changes from the main loop must be made with the tick interrupt blocked.
+ **********************************************************************************/
+
+void MM_RAMP_set(MM_ramp * ramp, MM_q15 target) {
+    ramp->target = (target > 0) ? target : 0;
+}
+
+void MM_RAMP_stop(MM_ramp * ramp) {
+    ramp->target = 0;
+    ramp->value = 0;
+    ramp->rate = 0;
+}
+
+/*
+ * Linear ramp, step clamped to the up and down limits.
+ */
+static MM_q15 MM_RAMP_linear(MM_ramp * ramp, int16_t err) {
+    if (err > ramp->cfg->up) {
+        err = ramp->cfg->up;
+    }
+    else if (err < -ramp->cfg->down) {
+        err = -ramp->cfg->down;
+    }
+    ramp->value += err;
+    return ramp->value;
+}
+
+MM_q15 MM_RAMP_tick(MM_ramp * ramp) {
+    // both are 0 to MM_Q15_MAX, so difference fits
+    int16_t err = ramp->target - ramp->value;
+    int16_t accel = ramp->cfg->accel;
+    int16_t limit;
+    int16_t dist;
+    int16_t speed;
+    int32_t value;
+
+    if ((err == 0) && (ramp->rate == 0)) {
+        return ramp->value;
+    }
+    if (!accel) {
+        return MM_RAMP_linear(ramp, err);
+    }
+
+    // work with speed towards target, and distance to it
+    if (err >= 0) {
+        dist = err;
+        speed = ramp->rate;
+        limit = ramp->cfg->up;
+    }
+    else {
+        dist = -err;
+        speed = -ramp->rate;
+        limit = ramp->cfg->down;
+    }
+
+    if ((speed > 0) &&
+        (((int32_t)speed * speed >= ((int32_t)accel * dist) << 1) ||
+         (speed > limit))) {
+        // brake, but keep moving so target is always reached
+        speed -= accel;
+        if (speed < accel) {
+            speed = accel;
+        }
+    }
+    else {
+        speed += accel;
+        if (speed > limit) {
+            speed = limit;
+        }
+    }
+
+    // arrived
+    if (speed >= dist) {
+        ramp->value = ramp->target;
+        ramp->rate = 0;
+        return ramp->value;
+    }
+
+    ramp->rate = (err >= 0) ? speed : -speed;
+    // moving away from target after a reversal can run into the limits
+    value = (int32_t)ramp->value + ramp->rate;
+    if (value < 0) {
+        value = 0;
+        ramp->rate = 0;
+    }
+    else if (value > MM_Q15_MAX) {
+        value = MM_Q15_MAX;
+        ramp->rate = 0;
+    }
+    ramp->value = (MM_q15)value;
+    return ramp->value;
+}
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <MM_fixed.h>
+#include <MM_speed.h>
+
+/**********************************************************************************
+ * @File     MM_speed.c
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Wheel speed matching for the MiniMech robot.
+ **********************************************************************************
+ * The two motors never quite match, so driving both at the same duty
+ * makes the robot curve. When both wheels are asked for the same duty, a
+ * PI loop run every MM_SPEED_PERIOD_MS compares their encoder edge counts
+ * and returns a correction, taken off the faster wheel's duty and added
+ * to the slower one's. The integral is held within MM_SPEED_CORR_MAX to
+ * stop wind-up, and cleared when the wheels are asked for different
+ * duties (steering, or stopped).
+ *
+ * All maths is Q15 (MM_fixed.h). Speed error is scaled so that
+ * MM_SPEED_FULL_COUNTS edges, full speed, is 1.0.
+ *
+ * MM_SPEED_simTick() models each wheel as a first-order lag on duty times
+ * a gain, producing edges from a phase accumulator, so the loop can be
+ * run without encoders fitted (MM_ENCODER = MM_ENCODER_SIM).
+ **********************************************************************************/
+
+uint16_t MM_SPEED_COUNT_L = 0;
+uint16_t MM_SPEED_COUNT_R = 0;
+MM_q15 MM_SPEED_CORR = 0;
+
+static MM_q15 MM_SPEED_INTEG = 0;
+
+// Q15 speed per encoder edge
+#define MM_SPEED_PER_COUNT  ((int16_t)(MM_Q15_MAX / MM_SPEED_FULL_COUNTS))
+
+MM_q15 MM_SPEED_update(uint16_t count_l, uint16_t count_r, uint8_t straight) {
+    int32_t err;
+
+    MM_SPEED_COUNT_L = count_l;
+    MM_SPEED_COUNT_R = count_r;
+
+    if (!straight) {
+        MM_SPEED_INTEG = 0;
+        MM_SPEED_CORR = 0;
+        return 0;
+    }
+
+    // > 0 when left wheel is faster
+    err = ((int32_t)count_l - count_r) * MM_SPEED_PER_COUNT;
+    if (err > MM_Q15_MAX) {
+        err = MM_Q15_MAX;
+    }
+    else if (err < MM_Q15_MIN) {
+        err = MM_Q15_MIN;
+    }
+
+    MM_SPEED_INTEG = MM_FX_clamp15(
+        MM_FX_add15(MM_SPEED_INTEG, MM_FX_mul15(MM_SPEED_KI, (MM_q15)err)),
+        -MM_SPEED_CORR_MAX, MM_SPEED_CORR_MAX);
+    MM_SPEED_CORR = MM_FX_clamp15(
+        MM_FX_add15(MM_FX_mul15(MM_SPEED_KP, (MM_q15)err), MM_SPEED_INTEG),
+        -MM_SPEED_CORR_MAX, MM_SPEED_CORR_MAX);
+    return MM_SPEED_CORR;
+}
+
+#if MM_ENCODER == MM_ENCODER_SIM
+
+// edges per ms at full speed, x256 for the phase accumulators
+#define MM_SIM_EDGES_X256 \
+    ((uint16_t)(((uint32_t)MM_SPEED_FULL_COUNTS << 8) / MM_SPEED_PERIOD_MS))
+
+static MM_q15 MM_SIM_SPEED_L = 0;
+static MM_q15 MM_SIM_SPEED_R = 0;
+static uint8_t MM_SIM_PHASE_L = 0;
+static uint8_t MM_SIM_PHASE_R = 0;
+
+/*
+ * Advance one simulated wheel. Phase is the fraction of an edge left
+ * over, in 1/256ths.
+ */
+static uint8_t MM_SPEED_simWheel(MM_q15 * speed, uint8_t * phase,
+                                 MM_q15 duty, MM_q15 gain) {
+    uint16_t edges;
+
+    *speed += (MM_FX_mul15(duty, gain) - *speed) >> MM_SIM_LAG_SHIFT;
+    edges = MM_FX_scale15(*speed, MM_SIM_EDGES_X256) + *phase;
+    *phase = (uint8_t)edges;
+    return (uint8_t)(edges >> 8);
+}
+
+void MM_SPEED_simTick(MM_q15 duty_l, MM_q15 duty_r,
+                      uint16_t * count_l, uint16_t * count_r) {
+    *count_l += MM_SPEED_simWheel(&MM_SIM_SPEED_L, &MM_SIM_PHASE_L,
+                                  duty_l, MM_SIM_GAIN_L);
+    *count_r += MM_SPEED_simWheel(&MM_SIM_SPEED_R, &MM_SIM_PHASE_R,
+                                  duty_r, MM_SIM_GAIN_R);
+}
+
+#endif
@@ -2,6 +2,12 @@
 #include <stm8s.h>
 #include <string.h>
 #include <MM_lib.h>
+#include <MM_stm8s.h>
+#include <MM_trace.h>
+#include <MM_latency.h>
+#include <MM_ramp.h>
+#include <MM_speed.h>
+#include <MM_store.h>
 
 /**********************************************************************************
  * @File     MM_stm8s.c
@@ -22,56 +28,779 @@
  *  Blue LED:       PA0
  *  Left motor:     PB1
  *  Right motor:    PB0
+ *  System tick:    TIM4 (1ms)
+ *  Control loop:   TIM4, every MM_CTRL_PERIOD_MS
+ *  Interrupt priorities: see MM_IRQ_PRIORITIES
+ *  Low power:      WFI when idle, active-halt with AWU, PA5 wake-up,
+ *                  clock governor (see MM_CLOCKS)
+ *  Clock:          HSI, or HSE with clock security fallback (MM_CLK_HSE)
+ *  Watchdog:       IWDG, refreshed while tasks check in (MM_WDG_TASKS)
  * 
  ***********************************************************************************/
 
+// Every supported rate must be within 2% at every clock level, and TIM1
+// must divide down exactly. The tick must fit TIM4, and at 50 counts or
+// more rounding keeps it within 1% of 1ms.
+#define MM_X_BAUD_OK(fclk, baud) && MM_UART_BAUD_OK(fclk, baud)
+#define MM_X_CLOCK_CHECK(clk, hsidiv, cpudiv, fclk, tim4, tim2) \
+    typedef char MM_BAUD_CHECK_##clk[ \
+        (1 MM_BAUD_RATES(MM_X_BAUD_OK, fclk)) ? 1 : -1]; \
+    typedef char MM_TICK_CHECK_##clk[ \
+        ((MM_TICK_COUNTS(fclk, tim4) >= 50) && \
+         (MM_TICK_COUNTS(fclk, tim4) <= 256)) ? 1 : -1]; \
+    typedef char MM_TIM1_CHECK_##clk[((fclk) % MM_TIM1_HZ == 0) ? 1 : -1];
+MM_CLOCKS(MM_X_CLOCK_CHECK)
+#undef MM_X_CLOCK_CHECK
+#undef MM_X_BAUD_OK
+
+#if MM_CLK_HSE
+// the crystal takes over PA1 and PA2
+typedef char MM_HSE_PIN_CHECK[
+    (MM_LED_MASK & (GPIO_PIN_1 | GPIO_PIN_2)) ? -1 : 1];
+#endif
+
+// baud rate register values, indexed by MM_clock then MM_baud_rate
+static const MM_baud MM_BAUD_TABLE[MM_NUM_CLOCKS][MM_NUM_BAUDS] = {
+#define MM_X_BAUD_TABLE(fclk, baud) MM_BAUD(fclk, baud),
+#define MM_X_CLOCK_BAUDS(clk, hsidiv, cpudiv, fclk, tim4, tim2) \
+    [clk] = { MM_BAUD_RATES(MM_X_BAUD_TABLE, fclk) },
+    MM_CLOCKS(MM_X_CLOCK_BAUDS)
+#undef MM_X_CLOCK_BAUDS
+#undef MM_X_BAUD_TABLE
+};
+
+// Clock level settings, see MM_CLOCKS. Stamp is MM_STAMP_US units per
+// TIM4 count x256, scaled so a tick is always 1000 / MM_STAMP_US stamps.
+typedef struct {
+    CLK_Prescaler_TypeDef hsidiv;
+    CLK_Prescaler_TypeDef cpudiv;
+    TIM4_Prescaler_TypeDef tim4;
+    uint8_t tick;       // TIM4 reload, counts per tick - 1
+    uint16_t stamp;
+    TIM2_Prescaler_TypeDef tim2;
+    uint16_t pwm;       // TIM2 counts per PWM period
+    uint8_t pwm_us;     // microseconds per TIM2 count x16
+    uint16_t tim1;
+} MM_clock_cfg;
+
+#define MM_CLK_STAMP(fclk, tim4) \
+    ((uint16_t)((((1000UL / MM_STAMP_US) << 8) + \
+                 MM_TICK_COUNTS(fclk, tim4) / 2) / MM_TICK_COUNTS(fclk, tim4)))
+#define MM_CLK_PWM_US(fclk, tim2) \
+    ((uint8_t)((16000000UL + ((uint32_t)(fclk) >> (tim2)) / 2) / \
+               ((uint32_t)(fclk) >> (tim2))))
+
+static const MM_clock_cfg MM_CLOCK_TABLE[MM_NUM_CLOCKS] = {
+#define MM_X_CLOCK_TABLE(clk, hsidiv, cpudiv, fclk, tim4, tim2) \
+    [clk] = { hsidiv, cpudiv, \
+              tim4, (uint8_t)(MM_TICK_COUNTS(fclk, tim4) - 1), \
+              MM_CLK_STAMP(fclk, tim4), \
+              tim2, MM_PWM_COUNTS(fclk, tim2), MM_CLK_PWM_US(fclk, tim2), \
+              MM_TIM1_PSC(fclk) },
+    MM_CLOCKS(MM_X_CLOCK_TABLE)
+#undef MM_X_CLOCK_TABLE
+};
+
+#undef MM_CLK_STAMP
+#undef MM_CLK_PWM_US
+
+// Current clock level, and the fast and slow levels of the active clock
+// source for the governor. Only changed with interrupts blocked.
+static MM_clock MM_CLK = MM_CLK_FAST;
+static MM_clock MM_CLK_HI = MM_CLK_FAST;
+static MM_clock MM_CLK_LO = MM_CLK_SLOW;
+static MM_baud_rate MM_BT_RATE = MM_BT_BAUD;
+static MM_baud_rate MM_T2S_RATE = MM_T2S_BAUD;
+
+// reset cause, read at init
+static MM_reset_cause MM_RESET = MM_RESET_COLD;
+
+// 1 if priority plan read back correctly, see MM_MCU_irqPlanCheck()
+uint8_t MM_IRQ_PLAN_OK = 0;
+
+/*
+ * Read back the interrupt priority plan. The STM8 nests interrupts itself:
+ * entering an ISR raises the CPU to that ISR's level, and IRET restores
+ * it. SDCC ISRs don't touch the level, so nesting works as long as each 
+ * level made it into the ITC's ISPR registers.
+ */
+static uint8_t MM_MCU_irqPlanCheck(void) {
+#define MM_X_IRQ_CHECK(irq, level) \
+    if (ITC_GetSoftwarePriority(irq) != (level)) { \
+        return 0; \
+    }
+    MM_IRQ_PRIORITIES(MM_X_IRQ_CHECK)
+#undef MM_X_IRQ_CHECK
+    return 1;
+}
+
+#if MM_CLK_HSE
+// flash wait state option byte (OPT7, NOPT7 follows), and its bit for 1
+// wait state, needed above 16MHz
+#define MM_OPT_WAITSTATE    0x480D
+#define MM_OPT_WAITSTATE_1  0x01
+
+/*
+ * 1 if flash is set up for 1 wait state. If not, the option byte is 
+ * programmed, but it is only loaded at reset so can't be relied on until
+ * the next boot.
+ */
+static uint8_t MM_MCU_flashWaitState(void) {
+    uint16_t opt = FLASH_ReadOptionByte(MM_OPT_WAITSTATE);
+
+    if ((opt != FLASH_OPTIONBYTE_ERROR) && 
+        ((opt >> 8) & MM_OPT_WAITSTATE_1)) {
+        return 1;
+    }
+    FLASH_Unlock(FLASH_MEMTYPE_DATA);
+    FLASH_ProgramOptionByte(MM_OPT_WAITSTATE, MM_OPT_WAITSTATE_1);
+    FLASH_Lock(FLASH_MEMTYPE_DATA);
+    return 0;
+}
+#endif
+
+/*
+ * Switch to the crystal when built with MM_CLK_HSE, staying on HSI if it
+ * hasn't started within the SPL's switch timeout, or flash isn't yet set
+ * up for 24MHz (see MM_MCU_flashWaitState()). From then on the clock 
+ * security system watches it, see CLK_IRQHandler.
+ */
+static void MM_MCU_startClock(void) {
+#if MM_CLK_HSE
+    if (!MM_MCU_flashWaitState()) {
+        return;
+    }
+    if (CLK_ClockSwitchConfig(CLK_SWITCHMODE_AUTO, CLK_SOURCE_HSE, DISABLE,
+                              CLK_CURRENTCLOCKSTATE_DISABLE) == SUCCESS) {
+        MM_CLK = MM_CLK_HSE_FAST;
+        MM_CLK_HI = MM_CLK_HSE_FAST;
+        MM_CLK_LO = MM_CLK_HSE_SLOW;
+        CLK_ClockSecuritySystemEnable();
+        CLK_ITConfig(CLK_IT_CSSD, ENABLE);
+    }
+    else {
+        // abandon the switch and stop the crystal
+        CLK->SWCR &= (uint8_t)~(CLK_SWCR_SWBSY | CLK_SWCR_SWEN);
+        CLK_HSECmd(DISABLE);
+    }
+#endif
+}
+
+/*
+ * Read the reset cause. The flags survive every reset except power-on, so
+ * they are cleared once read, or a later pin reset would look the same.
+ */
+static MM_reset_cause MM_MCU_readReset(void) {
+    MM_reset_cause cause = MM_RESET_COLD;
+
+    if ((RST_GetFlagStatus(RST_FLAG_IWDGF) == SET) || 
+        (RST_GetFlagStatus(RST_FLAG_WWDGF) == SET)) {
+        cause = MM_RESET_WATCHDOG;
+    }
+    else if (RST_GetFlagStatus(RST_FLAG_ILLOPF) == SET) {
+        cause = MM_RESET_SOFTWARE;
+    }
+    RST_ClearFlag((RST_Flag_TypeDef)(RST_FLAG_EMCF | RST_FLAG_SWIMF | 
+                  RST_FLAG_ILLOPF | RST_FLAG_IWDGF | RST_FLAG_WWDGF));
+    return cause;
+}
+
+MM_reset_cause MM_MCU_resetCause(void) {
+    return MM_RESET;
+}
+
 /*
  * Configure clock, GPIOs, UARTS chip on startup
  */
 void MM_MCU_init(void) { 
+    const MM_clock_cfg * cfg;
+    uint8_t wdg[2];
+
+    MM_RESET = MM_MCU_readReset();
+    MM_TRACE(MM_TRC_BOOT, MM_RESET);
     // configure clock
-    CLK_HSIPrescalerConfig(CLK_PRESCALER_HSIDIV1);  
+    MM_MCU_startClock();
+    cfg = &MM_CLOCK_TABLE[MM_CLK];
+    CLK_SYSCLKConfig(cfg->hsidiv);
+    CLK_SYSCLKConfig(cfg->cpudiv);
+
+    // WATCHDOG
+    // Last run's deadline misses are read back from the store, then the
+    // IWDG is armed at its longest timeout. The tick ISR refreshes it once
+    // interrupts are enabled, see MM_MCU_wdgTick().
+    MM_STORE_init();
+    if (MM_STORE_get(MM_KEY_WDG, wdg)) {
+        MM_WDG_MISSES = wdg[0];
+        MM_WDG_LAST = wdg[1];
+    }
+    IWDG_Enable();
+    IWDG_WriteAccessCmd(IWDG_WriteAccess_Enable);
+    IWDG_SetPrescaler(IWDG_Prescaler_256);
+    IWDG_SetReload(0xFF);
+    IWDG_ReloadCounter();
+
     // Set PA5 as Output open-drain high-impedance level for UART1_Tx
     GPIO_Init(GPIOA, GPIO_PIN_5, GPIO_MODE_OUT_OD_HIZ_FAST);
 
     // INITIALISE GPIO PINS
-    // Initialise four LED pins:
+    // Initialise four LED pins (see MM_LED_PINS):
     // PA3 = Orange, PA2 = Red, PA1 = Green, PA0 = Blue
-    GPIO_Init(GPIOA, GPIO_PIN_3 | GPIO_PIN_2 | GPIO_PIN_1 | GPIO_PIN_0,
-        GPIO_MODE_OUT_PP_LOW_FAST);
+    GPIO_Init(GPIOA, (GPIO_Pin_TypeDef)MM_LED_MASK, GPIO_MODE_OUT_PP_LOW_FAST);
 
-    // Initialise two motor pins:
+    // Initialise two motor pins (see MM_MOTOR_PINS):
     // PB1 = Left, PB0 = right
-    GPIO_Init(GPIOB, GPIO_PIN_1 | GPIO_PIN_0,
-        GPIO_MODE_OUT_PP_LOW_FAST);
+    GPIO_Init(GPIOB, (GPIO_Pin_TypeDef)MM_MOTOR_MASK, GPIO_MODE_OUT_PP_LOW_FAST);
 
     // INITIALISE UARTs
+    // 8-N-1 is the reset configuration, so only the precomputed baud 
+    // rate registers need writing before enabling TX and RX.
     // UART1: bluetooth module
     UART1_DeInit();
-    UART1_Init((uint32_t)9600, UART1_WORDLENGTH_8D, UART1_STOPBITS_1, UART1_PARITY_NO,
-                UART1_SYNCMODE_CLOCK_DISABLE, UART1_MODE_TXRX_ENABLE);
+    MM_MCU_setBaud("BT", MM_BT_BAUD);
+    UART1->CR2 = UART1_CR2_TEN | UART1_CR2_REN | UART1_CR2_RIEN;
     // Enable UART1 Half Duplex Mode
     UART1_HalfDuplexCmd(ENABLE);
 
     // UART3: T2S module
     UART3_DeInit();
-    UART3_Init((uint32_t)9600, UART3_WORDLENGTH_8D, UART3_STOPBITS_1, UART3_PARITY_NO,
-                UART3_MODE_TXRX_ENABLE);
+    MM_MCU_setBaud("T2S", MM_T2S_BAUD);
+    UART3->CR2 = UART3_CR2_TEN | UART3_CR2_REN;
+
+    // SYSTEM TICK
+    // TIM4: 16MHz / 128 = 125kHz, 125 counts per update = 1ms. Reload is
+    // preloaded so a clock change takes effect at the next update.
+    TIM4_TimeBaseInit(cfg->tim4, cfg->tick);
+    TIM4_ARRPreloadConfig(ENABLE);
+    TIM4_ClearFlag(TIM4_FLAG_UPDATE);
+    TIM4_ITConfig(TIM4_IT_UPDATE, ENABLE);
+    TIM4_Cmd(ENABLE);
+
+    // MOTOR PWM
+    // TIM2: 16MHz / 16 = 1MHz, 1000 counts per period. Motor pins are set
+    // on update and cleared on compare (CC1 = left, CC2 = right) by 
+    // interrupt, so motors can be on any port B pin. Reload and compare
+    // values are preloaded so period and duty changes take effect at the
+    // start of a period.
+    TIM2_TimeBaseInit(cfg->tim2, cfg->pwm - 1);
+    TIM2_ARRPreloadConfig(ENABLE);
+    TIM2_OC1PreloadConfig(ENABLE);
+    TIM2_OC2PreloadConfig(ENABLE);
+    TIM2_SetCompare1(cfg->pwm);
+    TIM2_SetCompare2(cfg->pwm);
+    // load prescaler and compare values now rather than at first update
+    TIM2_GenerateEvent(TIM2_EVENTSOURCE_UPDATE);
+    TIM2->SR1 = 0;
+    TIM2_ITConfig((TIM2_IT_TypeDef)(TIM2_IT_UPDATE | TIM2_IT_CC1 | TIM2_IT_CC2), 
+                  ENABLE);
+    TIM2_Cmd(ENABLE);
+
+#if MM_ENCODER == MM_ENCODER_TIM1
+    // WHEEL ENCODERS
+    // Slotted wheels on TIM1 CH1 (PC1) = left, CH2 (PC2) = right. Each 
+    // rising edge is captured and counted by TIM1_CAP_COM_IRQHandler, with
+    // the maximum input filter to reject bounce. TIM1's encoder interface
+    // mode can only decode one quadrature wheel, so both channels are used
+    // as plain input captures instead.
+    GPIO_Init(GPIOC, (GPIO_Pin_TypeDef)(GPIO_PIN_1 | GPIO_PIN_2), 
+              GPIO_MODE_IN_PU_NO_IT);
+    TIM1_TimeBaseInit(cfg->tim1, TIM1_COUNTERMODE_UP, 
+                      0xFFFF, 0);
+    TIM1_ICInit(TIM1_CHANNEL_1, TIM1_ICPOLARITY_RISING, 
+                TIM1_ICSELECTION_DIRECTTI, TIM1_ICPSC_DIV1, 0x0F);
+    TIM1_ICInit(TIM1_CHANNEL_2, TIM1_ICPOLARITY_RISING, 
+                TIM1_ICSELECTION_DIRECTTI, TIM1_ICPSC_DIV1, 0x0F);
+    TIM1_ITConfig((TIM1_IT_TypeDef)(TIM1_IT_CC1 | TIM1_IT_CC2), ENABLE);
+    TIM1_Cmd(ENABLE);
+#endif
+
+    // LOW POWER
+    // Active-halt, see MM_MCU_idle(). The AWU runs from the LSI, and the
+    // main regulator and flash are powered down while halted for the 
+    // lowest current, at the cost of a slower wake-up. Bluetooth wakes 
+    // the MCU by a falling edge on PA5 (UART1 half duplex line), only 
+    // enabled while halted.
+    CLK_LSICmd(ENABLE);
+    AWU_Init(MM_IDLE_AWU);
+    AWU_Cmd(DISABLE);
+    CLK_SlowActiveHaltWakeUpCmd(ENABLE);
+    FLASH_SetLowPowerMode(FLASH_LPMODE_POWERDOWN);
+    EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOA, EXTI_SENSITIVITY_FALL_ONLY);
+
+    // INTERRUPT PRIORITIES
+    // Interrupts are still disabled from reset, as ITC writes require
+#define MM_X_IRQ_PRIORITY(irq, level) ITC_SetSoftwarePriority(irq, level);
+    MM_IRQ_PRIORITIES(MM_X_IRQ_PRIORITY)
+#undef MM_X_IRQ_PRIORITY
+    MM_IRQ_PLAN_OK = MM_MCU_irqPlanCheck();
+
+    enableInterrupts();
+}
+
+/*
+ * System tick, incremented once per ms by TIM4_UPD_OVF_IRQHandler.
+ * Wraps every ~65s, so compare tick values by difference only.
+ */
+volatile uint16_t MM_TICKS = 0;
+
+/*
+ * Motors with PWM running, as a port B pin mask. Pins are set by the TIM2
+ * update interrupt, so anything stopping the motors from an ISR must clear
+ * this as well as the pins.
+ */
+static volatile uint8_t MM_PWM_ON = 0;
+
+// motor duty ramps (see MM_ramp.h), ticked by the control loop
+static const MM_ramp_cfg MM_RAMP_CFGS[MM_NUM_MOTORS] = {
+    [MM_MOTOR_L] = MM_RAMP_CFG(MM_RAMP_UP_MS_L, MM_RAMP_DOWN_MS_L),
+    [MM_MOTOR_R] = MM_RAMP_CFG(MM_RAMP_UP_MS_R, MM_RAMP_DOWN_MS_R),
+};
+static MM_ramp MM_MOTOR_RAMP[MM_NUM_MOTORS] = {
+    [MM_MOTOR_L] = { &MM_RAMP_CFGS[MM_MOTOR_L] },
+    [MM_MOTOR_R] = { &MM_RAMP_CFGS[MM_MOTOR_R] },
+};
+
+// worst-case interrupt latencies, in us
+volatile uint16_t MM_IRQ_LATENCY[MM_NUM_IRQ_LAT];
+
+/*
+ * Record an interrupt latency. Each source is only written by its own 
+ * ISR.
+ */
+static void MM_MCU_irqLatency(MM_irq_lat src, uint16_t us) {
+    if (us > MM_IRQ_LATENCY[src]) {
+        MM_IRQ_LATENCY[src] = us;
+    }
+}
+
+static void MM_MCU_applyOutputs(void);
+static void MM_MCU_rampTick(void);
+#if MM_ENCODER != MM_ENCODER_NONE
+static void MM_MCU_speedTick(void);
+#endif
+
+/*
+ * Stop motors dead from an ISR, skipping the ramps. MM_MCU_applyOutputs()
+ * must keep their targets at 0 after this. Blocks the PWM ISRs, which 
+ * also write port B, when called from the tick.
+ */
+static void MM_MCU_motorStop(void) {
+    __critical {
+        MM_PWM_ON = 0;
+        GPIOB->ODR &= (uint8_t)~MM_MOTOR_MASK;
+#define MM_X_MOTOR_STOP(dev, port, pin) MM_RAMP_stop(&MM_MOTOR_RAMP[dev]);
+        MM_MOTOR_PINS(MM_X_MOTOR_STOP)
+#undef MM_X_MOTOR_STOP
+    }
+}
+
+/*
+ * Link supervision. ms since the last control frame from the app, counted
+ * by the control loop once armed by the first MM_MCU_linkAlive(), so it 
+ * keeps working if the main loop stalls.
+ */
+static volatile uint16_t MM_LINK_IDLE = 0;
+static volatile uint8_t MM_LINK_ARMED = 0;
+volatile uint8_t MM_LINK_LOST = 0;
+
+/*
+ * Bluetooth activity for low power. Any byte from the app sets the flag
+ * (from the RX ISR), and the control loop counts ms without one, 
+ * saturating.
+ */
+static volatile uint8_t MM_BT_ACTIVITY = 0;
+static volatile uint16_t MM_BT_QUIET = 0;
+
+/*
+ * Watchdog. ms since each task's last MM_MCU_heartbeat(), counted by the
+ * tick ISR, MM_WDG_UNWATCHED until its first. Once a task misses its 
+ * deadline the IWDG is no longer refreshed.
+ */
+#define MM_WDG_UNWATCHED    0xFFFF
+
+static const uint16_t MM_WDG_DEADLINE[MM_NUM_WDG_TASKS] = {
+#define MM_X_WDG_DEADLINE(task, ms) [task] = (ms),
+    MM_WDG_TASKS(MM_X_WDG_DEADLINE)
+#undef MM_X_WDG_DEADLINE
+};
+static uint16_t MM_WDG_AGE[MM_NUM_WDG_TASKS] = {
+#define MM_X_WDG_AGE(task, ms) [task] = MM_WDG_UNWATCHED,
+    MM_WDG_TASKS(MM_X_WDG_AGE)
+#undef MM_X_WDG_AGE
+};
+static uint8_t MM_WDG_FAULT = 0;
+uint8_t MM_WDG_MISSES = 0;
+uint8_t MM_WDG_LAST = MM_WDG_NONE;
+
+// AWU and IWDG both run from the LSI, so this holds whatever its error
+typedef char MM_WDG_AWU_CHECK[
+    (2 * MM_IDLE_AWU_MS <= MM_WDG_TIMEOUT_MS) ? 1 : -1];
+
+/*
+ * Task is alive, restart its deadline.
+ */
+void MM_MCU_heartbeat(MM_wdg_task task) {
+    __critical {
+        MM_WDG_AGE[task] = 0;
+    }
+}
+
+/*
+ * A task missed its deadline. Whatever should be driving the motors may 
+ * be stuck, so they are stopped and held off as by an e-stop, then the 
+ * miss is saved before the IWDG resets the MCU. It is saved directly from
+ * here, as the main loop could be stuck anywhere.
+ */
+static void MM_MCU_wdgMiss(MM_wdg_task task) {
+    uint8_t wdg[2];
+
+    MM_WDG_FAULT = 1;
+    MM_ESTOP = 1;
+    MM_MCU_motorStop();
+    if (MM_WDG_MISSES != 0xFF) {
+        MM_WDG_MISSES++;
+    }
+    MM_WDG_LAST = task;
+    wdg[0] = MM_WDG_MISSES;
+    wdg[1] = MM_WDG_LAST;
+    // lost if the main loop was part way through changing the store
+    MM_STORE_setNow(MM_KEY_WDG, wdg);
+}
+
+/*
+ * Age the watched tasks by one tick, and refresh the IWDG if all are 
+ * within their deadlines. Called from the tick ISR.
+ */
+static void MM_MCU_wdgTick(void) {
+    uint8_t task;
+
+    if (MM_WDG_FAULT) {
+        return;
+    }
+    for (task = 0; task < MM_NUM_WDG_TASKS; task++) {
+        if (MM_WDG_AGE[task] == MM_WDG_UNWATCHED) {
+            continue;
+        }
+        if (++MM_WDG_AGE[task] > MM_WDG_DEADLINE[task]) {
+            MM_MCU_wdgMiss((MM_wdg_task)task);
+            return;
+        }
+    }
+    IWDG_ReloadCounter();
+}
+
+// control period must be a whole number of ticks, and of speed loop periods
+typedef char MM_CTRL_HZ_CHECK[((1000 % MM_CTRL_HZ) == 0) ? 1 : -1];
+#if MM_ENCODER != MM_ENCODER_NONE
+typedef char MM_SPEED_PERIOD_CHECK[
+    ((MM_SPEED_PERIOD_MS % MM_CTRL_PERIOD_MS) == 0) ? 1 : -1];
+#endif
+
+// ticks since last control step, and control loop timing
+static uint8_t MM_CTRL_TICK = 0;
+static MM_ctrl_stats MM_CTRL_STATS = { 0, 0, 0xFF, 0, 0 };
+
+/*
+ * One step of the control loop, every MM_CTRL_PERIOD_MS from the tick 
+ * ISR so motor updates don't depend on how fast the main loop runs.
+ */
+static void MM_MCU_controlStep(void) {
+    if (MM_LINK_ARMED && !MM_LINK_LOST) {
+        MM_LINK_IDLE += MM_CTRL_PERIOD_MS;
+        if (MM_LINK_IDLE >= MM_LINK_TIMEOUT_MS) {
+            MM_LINK_LOST = 1;
+            // stop motors at the pins, MM_MCU_applyOutputs() keeps them off
+            MM_MCU_motorStop();
+            MM_TRACE(MM_TRC_LINK, 1);
+        }
+    }
+    if (MM_BT_ACTIVITY) {
+        MM_BT_ACTIVITY = 0;
+        MM_BT_QUIET = 0;
+    }
+    else if (MM_BT_QUIET <= (0xFFFF - MM_CTRL_PERIOD_MS)) {
+        MM_BT_QUIET += MM_CTRL_PERIOD_MS;
+    }
+    MM_MCU_applyOutputs();
+    MM_MCU_rampTick();
+#if MM_ENCODER != MM_ENCODER_NONE
+    MM_MCU_speedTick();
+#endif
+}
+
+/*
+ * TIM4 counts to stamps (MM_STAMP_US) at the current clock level.
+ */
+static inline uint8_t MM_MCU_tim4Stamps(uint8_t count) {
+    return (uint8_t)((count * MM_CLOCK_TABLE[MM_CLK].stamp) >> 8);
+}
+
+INTERRUPT_HANDLER(TIM4_UPD_OVF_IRQHandler, 23) {
+    // TIM4 counts on from the update that raised this interrupt, so this
+    // is how late the ISR started
+    uint8_t count = TIM4->CNTR;
+    uint8_t late = MM_MCU_tim4Stamps(count);
+    uint8_t busy;
+
+    // cleared first, so a step overrunning the next tick leaves it pending
+    // rather than losing it
+    TIM4_ClearITPendingBit(TIM4_IT_UPDATE);
+    MM_TICKS++;
+    MM_MCU_irqLatency(MM_IRQ_LAT_TICK, late * MM_STAMP_US);
+    MM_MCU_wdgTick();
+    if (++MM_CTRL_TICK >= MM_CTRL_PERIOD_MS) {
+        MM_CTRL_TICK = 0;
+        MM_MCU_controlStep();
+
+        busy = MM_MCU_tim4Stamps(TIM4->CNTR - count);
+        if (TIM4->SR1 & TIM4_SR1_UIF) {
+            // ran into the next tick, which will be serviced late
+            MM_CTRL_STATS.overruns++;
+            busy = 0xFF;
+        }
+        MM_CTRL_STATS.steps++;
+        if (late < MM_CTRL_STATS.late_min) {
+            MM_CTRL_STATS.late_min = late;
+        }
+        if (late > MM_CTRL_STATS.late_max) {
+            MM_CTRL_STATS.late_max = late;
+        }
+        if (busy > MM_CTRL_STATS.busy_max) {
+            MM_CTRL_STATS.busy_max = busy;
+        }
+    }
 }
 
 /*
- * Standard delay function. Uses Timer1. 
+ * Copy control loop timing, then restart the minima and maxima.
+ */
+void MM_MCU_ctrlStats(MM_ctrl_stats * stats) {
+    __critical {
+        *stats = MM_CTRL_STATS;
+        MM_CTRL_STATS.late_min = 0xFF;
+        MM_CTRL_STATS.late_max = 0;
+        MM_CTRL_STATS.busy_max = 0;
+    }
+}
+
+/*
+ * Valid control frame recieved from app. Restarts the link supervision
+ * timer, and lets the motors run again if the link had been lost.
+ */
+void MM_MCU_linkAlive(void) {
+    __critical {
+        MM_LINK_IDLE = 0;
+        MM_LINK_ARMED = 1;
+        if (MM_LINK_LOST) {
+            MM_LINK_LOST = 0;
+            MM_TRACE(MM_TRC_LINK, 0);
+        }
+    }
+}
+
+/*
+ * Read the system tick. 16-bit read is not atomic on the STM8, so
+ * block the tick interrupt while copying.
+ */
+uint16_t MM_MCU_getTicks(void) {
+    uint16_t ticks;
+    __critical {
+        ticks = MM_TICKS;
+    }
+    return ticks;
+}
+
+/*
+ * Fine timestamp in units of MM_STAMP_US, built from the system tick and
+ * the TIM4 counter, scaled to the clock level's counts per tick. Wraps
+ * every ~524ms, so only use for short intervals.
+ */
+uint16_t MM_MCU_getStamp(void) {
+    uint16_t ticks;
+    uint8_t count;
+    __critical {
+        ticks = MM_TICKS;
+        count = TIM4->CNTR;
+        // counter has wrapped but tick interrupt not yet serviced
+        if (TIM4->SR1 & TIM4_SR1_UIF) {
+            ticks++;
+            count = TIM4->CNTR;
+        }
+    }
+    return (ticks * (1000 / MM_STAMP_US)) + MM_MCU_tim4Stamps(count);
+}
+
+/*
+ * End of static data in RAM, ie bottom of the stack region.
+ * The linker emits s_<area>/l_<area> for each area, and INITIALIZED is the
+ * last area of static data in RAM.
+ */
+static uint16_t MM_MCU_dataEnd(void) __naked {
+    __asm
+        ldw x, #(s_INITIALIZED + l_INITIALIZED)
+        ret
+    __endasm;
+}
+
+/*
+ * Free RAM between the end of static data and the current stack pointer.
+ */
+uint16_t MM_MCU_ramFree(void) __naked {
+    __asm
+        ldw x, sp
+        subw x, #(s_INITIALIZED + l_INITIALIZED)
+        ret
+    __endasm;
+}
+
+/*
+ * Bytes of static data (DATA + INITIALIZED areas).
+ */
+uint16_t MM_MCU_ramStatic(void) {
+    return MM_MCU_dataEnd() - MM_RAM_START;
+}
+
+/*
+ * Fill unused stack with MM_STACK_PAINT. Must be called first thing in 
+ * main(), while the stack is at its shallowest. Leaves a few bytes below 
+ * the current stack pointer for this function's own call.
+ */
+void MM_MCU_stackPaint(void) {
+    uint8_t * p = (uint8_t *)MM_MCU_dataEnd();
+    uint8_t * end = p + MM_MCU_ramFree() - 16;
+    while (p < end) {
+        *p++ = MM_STACK_PAINT;
+    }
+}
+
+/*
+ * Smallest stack headroom seen since MM_MCU_stackPaint(), ie the number of 
+ * painted bytes above static data the stack has never reached. 
+ */
+uint16_t MM_MCU_stackUnused(void) {
+    uint8_t * start = (uint8_t *)MM_MCU_dataEnd();
+    uint8_t * p = start;
+    while (*p == MM_STACK_PAINT) {
+        p++;
+    }
+    return (uint16_t)(p - start);
+}
+
+// time spent asleep since last MM_MCU_cpuDuty(), in units of MM_STAMP_US
+static uint32_t MM_IDLE_SLEEP = 0;
+// tick of last MM_MCU_cpuDuty()
+static uint16_t MM_IDLE_START = 0;
+
+/*
+ * Sleep until the next interrupt, at most one tick. Time in the ISR that 
+ * wakes the CPU is counted as asleep.
+ */
+static void MM_MCU_sleep(void) {
+    uint16_t start = MM_MCU_getStamp();
+    wfi();
+    MM_IDLE_SLEEP += (uint16_t)(MM_MCU_getStamp() - start);
+}
+
+/*
+ * Standard delay function. Uses the system tick, as TIM1 is kept for 
+ * the wheel encoders. Sleeps between ticks.
  * Max delay = 1000ms.
  */
-uint16_t count_val = 0;
 void MM_MCU_delay(__IO uint32_t ms) {
-    // configure timer 1, 1000 ticks per second
-    TIM1_TimeBaseInit(16000, TIM1_COUNTERMODE_UP, 16000, 1);
-    // enable timer
-    TIM1_Cmd(ENABLE);
-    
-    count_val = TIM1_GetCounter();
-    while (TIM1_GetCounter() != ((count_val + ms) % 1000)){}
+    uint16_t start = MM_MCU_getTicks();
+    while ((uint16_t)(MM_MCU_getTicks() - start) < ms) {
+        MM_MCU_sleep();
+    }
+}
+
+/*
+ * Transmit queues for each UART, drained by the UART TX interrupts so 
+ * sending never waits on the wire unless a queue is full. 
+ * Single producer (main loop), single consumer (TX interrupt).
+ */
+typedef struct {
+    uint8_t buf[MM_TXQ_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+} MM_txq;
+
+static MM_txq MM_BT_TXQ;
+static MM_txq MM_T2S_TXQ;
+
+// bluetooth UART statistics, reported by telemetry
+volatile MM_uart_stats MM_BT_STATS;
+
+/*
+ * Bluetooth recieve queue, filled by UART1_RX_IRQHandler so bytes aren't 
+ * lost while the main loop is busy. Single producer (RX interrupt), single
+ * consumer (main loop).
+ */
+static uint8_t MM_BT_RXQ[MM_RXQ_SIZE];
+// arrival time of each queued byte, from MM_MCU_getStamp(), and the tick
+// it arrived at, to tell how long ago that was beyond the stamp's wrap
+static uint16_t MM_BT_RXQ_STAMP[MM_RXQ_SIZE];
+static uint16_t MM_BT_RXQ_TICK[MM_RXQ_SIZE];
+static volatile uint8_t MM_BT_RXQ_HEAD = 0;
+static volatile uint8_t MM_BT_RXQ_TAIL = 0;
+
+// 1 while emergency stop is latched, see MM_MCU_estopClear()
+volatile uint8_t MM_ESTOP = 0;
+
+/*
+ * Emergency stop is handled here rather than by the bluetooth library, so
+ * motors are cut one byte time after the app sends it, however busy the 
+ * main loop is. Errors are counted and damaged bytes dropped, as is a 
+ * byte arriving with the queue full (counted as an overrun).
+ */
+INTERRUPT_HANDLER(UART1_RX_IRQHandler, 18) {
+    // reading SR then DR clears RXNE and the error flags
+    uint8_t status = UART1->SR;
+    uint8_t byte = UART1->DR;
+    uint8_t next;
+
+    MM_BT_ACTIVITY = 1;
+    if (status & UART1_SR_OR) MM_BT_STATS.overrun++;
+    if (status & UART1_SR_NF) MM_BT_STATS.noise++;
+    if (status & UART1_SR_FE) {
+        MM_BT_STATS.framing++;
+        return;
+    }
+    MM_BT_STATS.rx_bytes++;
+
+    // only once the app is sending control frames. Before then 0xEE can 
+    // turn up in module replies at the wrong baud rate, and in phrases.
+    if ((byte == MM_ESTOP_BYTE) && MM_LINK_ARMED) {
+        MM_MCU_motorStop();
+        MM_ESTOP = 1;
+    }
+
+    next = (MM_BT_RXQ_HEAD + 1) & (MM_RXQ_SIZE - 1);
+    if (next == MM_BT_RXQ_TAIL) {
+        MM_BT_STATS.overrun++;
+        return;
+    }
+    MM_BT_RXQ[MM_BT_RXQ_HEAD] = byte;
+    MM_BT_RXQ_STAMP[MM_BT_RXQ_HEAD] = MM_MCU_getStamp();
+    MM_BT_RXQ_TICK[MM_BT_RXQ_HEAD] = MM_MCU_getTicks();
+    MM_BT_RXQ_HEAD = next;
+    MM_TRACE(MM_TRC_BT_RX, byte);
+}
+
+/*
+ * Release emergency stop. Motors follow the output shadows again from the
+ * next MM_MCU_commitOutputs().
+ */
+void MM_MCU_estopClear(void) {
+    MM_ESTOP = 0;
+}
+
+/*
+ * Add a byte to a transmit queue, waiting while queue is full.
+ */
+static void MM_MCU_txqPush(MM_txq * q, uint8_t byte) {
+    uint8_t next = (q->head + 1) & (MM_TXQ_SIZE - 1);
+    while (next == q->tail){}
+    q->buf[q->head] = byte;
+    q->head = next;
 }
 
 /*
@@ -80,88 +809,709 @@ void MM_MCU_delay(__IO uint32_t ms) {
  */
 void MM_MCU_sendByte(char byte, char * module) {
     // send byte to BT module
-    if(strcmp(module, "BT")) {
-        // Wait until end of transmit
-        while (UART1_GetFlagStatus(UART1_FLAG_TXE) == RESET){}
-        // Write one byte in the UART1 Transmit Data Register
-        UART1_SendData8(byte);
+    if(!strcmp(module, "BT")) {
+        MM_MCU_txqPush(&MM_BT_TXQ, byte);
+        // (re)start transmit interrupt
+        UART1->CR2 |= UART1_CR2_TIEN;
+    }
+    else if(!strcmp(module, "T2S")) {
+        MM_MCU_txqPush(&MM_T2S_TXQ, byte);
+        UART3->CR2 |= UART3_CR2_TIEN;
+    }
+}
 
+/*
+ * Change a module's UART baud rate. Waits for any queued bytes to finish
+ * sending first. BRR2 must be written before BRR1, which latches both.
+ */
+void MM_MCU_setBaud(char * module, MM_baud_rate rate) {
+    const MM_baud * baud = &MM_BAUD_TABLE[MM_CLK][rate];
+    if(!strcmp(module, "BT")) {
+        while (MM_BT_TXQ.head != MM_BT_TXQ.tail){}
+        while (!(UART1->SR & UART1_SR_TC)){}
+        UART1->BRR2 = baud->brr2;
+        UART1->BRR1 = baud->brr1;
+        MM_BT_RATE = rate;
     }
-    else if(strcmp(module, "T2S")) {
-        // Wait until end of transmit
-        while (UART3_GetFlagStatus(UART1_FLAG_TXE) == RESET){}
-        // Write one byte in the UART3 Transmit Data Register
-        UART3_SendData8(byte);
+    else if(!strcmp(module, "T2S")) {
+        while (MM_T2S_TXQ.head != MM_T2S_TXQ.tail){}
+        while (!(UART3->SR & UART3_SR_TC)){}
+        UART3->BRR2 = baud->brr2;
+        UART3->BRR1 = baud->brr1;
+        MM_T2S_RATE = rate;
     }
 }
 
+// compare values last written to TIM2, 0xFFFF to force next write
+static uint16_t MM_PWM_CCR_LAST[MM_NUM_MOTORS] = {
+#define MM_X_MOTOR_CCR(dev, port, pin) [dev] = 0xFFFF,
+    MM_MOTOR_PINS(MM_X_MOTOR_CCR)
+#undef MM_X_MOTOR_CCR
+};
+
+/*
+ * Load a clock level's master clock, timer and baud rate settings. Call
+ * with interrupts blocked. New timer prescalers and reloads load at each
+ * timer's next update, so one tick and PWM period run at the wrong rate.
+ * PWM compare values are rewritten for the new period by the next 
+ * control step.
+ */
+static void MM_MCU_applyClock(MM_clock clk) {
+    const MM_clock_cfg * cfg = &MM_CLOCK_TABLE[clk];
+    const MM_baud * bt = &MM_BAUD_TABLE[clk][MM_BT_RATE];
+    const MM_baud * t2s = &MM_BAUD_TABLE[clk][MM_T2S_RATE];
+
+    CLK_SYSCLKConfig(cfg->hsidiv);
+    CLK_SYSCLKConfig(cfg->cpudiv);
+    TIM4->PSCR = cfg->tim4;
+    TIM4->ARR = cfg->tick;
+    TIM2->PSCR = cfg->tim2;
+    TIM2->ARRH = (uint8_t)((cfg->pwm - 1) >> 8);
+    TIM2->ARRL = (uint8_t)(cfg->pwm - 1);
+#define MM_X_MOTOR_CCR(dev, port, pin) MM_PWM_CCR_LAST[dev] = 0xFFFF;
+    MM_MOTOR_PINS(MM_X_MOTOR_CCR)
+#undef MM_X_MOTOR_CCR
+#if MM_ENCODER == MM_ENCODER_TIM1
+    TIM1->PSCRH = (uint8_t)(cfg->tim1 >> 8);
+    TIM1->PSCRL = (uint8_t)cfg->tim1;
+#endif
+    UART1->BRR2 = bt->brr2;
+    UART1->BRR1 = bt->brr1;
+    UART3->BRR2 = t2s->brr2;
+    UART3->BRR1 = t2s->brr1;
+    MM_CLK = clk;
+    MM_TRACE(MM_TRC_CLOCK, clk);
+}
+
+/*
+ * Switch to the fast or slow level of the active clock source. Transmit 
+ * interrupts are held off until both UARTs finish their current byte, so
+ * no byte goes out at a mix of rates, then everything changes together.
+ * A byte being recieved during the switch can still be damaged, and is 
+ * dropped as a framing error. The level is picked again with interrupts
+ * blocked, in case the clock security system changed source meanwhile.
+ */
+static void MM_MCU_setClock(uint8_t fast) {
+    if ((fast ? MM_CLK_HI : MM_CLK_LO) == MM_CLK) {
+        return;
+    }
+    UART1->CR2 &= (uint8_t)~UART1_CR2_TIEN;
+    UART3->CR2 &= (uint8_t)~UART3_CR2_TIEN;
+    while (!(UART1->SR & UART1_SR_TC) || !(UART3->SR & UART3_SR_TC)){}
+
+    __critical {
+        MM_MCU_applyClock(fast ? MM_CLK_HI : MM_CLK_LO);
+    }
+
+    // restart transmit interrupts for anything queued meanwhile
+    if (MM_BT_TXQ.head != MM_BT_TXQ.tail) {
+        UART1->CR2 |= UART1_CR2_TIEN;
+    }
+    if (MM_T2S_TXQ.head != MM_T2S_TXQ.tail) {
+        UART3->CR2 |= UART3_CR2_TIEN;
+    }
+}
+
+#if MM_CLK_HSE
+/*
+ * Clock security system found the crystal stopped. Hardware has already
+ * switched the master clock to HSI/8, so move everything onto the HSI 
+ * levels for good. Bytes in flight on either UART are lost.
+ */
+INTERRUPT_HANDLER(CLK_IRQHandler, 2) {
+    if (CLK_GetITStatus(CLK_IT_CSSD) == SET) {
+        CLK_ClearITPendingBit(CLK_IT_CSSD);
+        MM_CLK_HI = MM_CLK_FAST;
+        MM_CLK_LO = MM_CLK_SLOW;
+        MM_MCU_applyClock(MM_CLK_FAST);
+    }
+}
+#endif
+
+// MM_MCU_clockBoost() nesting, and tick of last demand for full speed
+static uint8_t MM_CLK_BOOST = 0;
+static uint16_t MM_CLK_DEMAND = 0;
+
+/*
+ * Ask for full speed for a burst of work, eg. phrase framing. Calls nest,
+ * the governor can slow down MM_CLK_SLOW_AFTER_MS after the last one ends.
+ */
+void MM_MCU_clockBoost(uint8_t on) {
+    if (on) {
+        MM_CLK_BOOST++;
+        MM_MCU_setClock(1);
+    }
+    else if (MM_CLK_BOOST) {
+        MM_CLK_BOOST--;
+    }
+    MM_CLK_DEMAND = MM_MCU_getTicks();
+}
+
+MM_clock MM_MCU_getClock(void) {
+    return MM_CLK;
+}
+
+/*
+ * Number of bytes that can be sent to a module without waiting.
+ */
+uint8_t MM_MCU_txFree(char * module) {
+    MM_txq * q = !strcmp(module, "BT") ? &MM_BT_TXQ : &MM_T2S_TXQ;
+    return (q->tail - q->head - 1) & (MM_TXQ_SIZE - 1);
+}
+
+/*
+ * Number of bytes waiting in a module's transmit queue.
+ */
+uint8_t MM_MCU_txPending(char * module) {
+    MM_txq * q = !strcmp(module, "BT") ? &MM_BT_TXQ : &MM_T2S_TXQ;
+    return (q->head - q->tail) & (MM_TXQ_SIZE - 1);
+}
+
+/*
+ * Returns 1 once a module's queue is empty and the last byte has left the
+ * shift register, so MM_MCU_setBaud() won't block.
+ */
+uint8_t MM_MCU_txIdle(char * module) {
+    if(!strcmp(module, "BT")) {
+        return (MM_BT_TXQ.head == MM_BT_TXQ.tail) && 
+               (UART1->SR & UART1_SR_TC);
+    }
+    return (MM_T2S_TXQ.head == MM_T2S_TXQ.tail) && 
+           (UART3->SR & UART3_SR_TC);
+}
+
+INTERRUPT_HANDLER(UART1_TX_IRQHandler, 17) {
+    if (MM_BT_TXQ.tail != MM_BT_TXQ.head) {
+        UART1->DR = MM_BT_TXQ.buf[MM_BT_TXQ.tail];
+        MM_BT_TXQ.tail = (MM_BT_TXQ.tail + 1) & (MM_TXQ_SIZE - 1);
+        MM_BT_STATS.tx_bytes++;
+    }
+    // queue empty, stop until next byte is queued
+    else UART1->CR2 &= (uint8_t)~UART1_CR2_TIEN;
+}
+
+INTERRUPT_HANDLER(UART3_TX_IRQHandler, 20) {
+    if (MM_T2S_TXQ.tail != MM_T2S_TXQ.head) {
+        UART3->DR = MM_T2S_TXQ.buf[MM_T2S_TXQ.tail];
+        MM_T2S_TXQ.tail = (MM_T2S_TXQ.tail + 1) & (MM_TXQ_SIZE - 1);
+    }
+    else UART3->CR2 &= (uint8_t)~UART3_CR2_TIEN;
+}
+
+/*
+ * Returns 1 if a byte from a module is waiting to be read.
+ */
+uint8_t MM_MCU_rxReady(char * module) {
+    if(!strcmp(module, "BT")) {
+        return MM_BT_RXQ_HEAD != MM_BT_RXQ_TAIL;
+    }
+    return (UART3->SR & UART3_SR_RXNE) != 0;
+}
+
+/*
+ * Drop any bytes from a module that haven't been read yet.
+ */
+void MM_MCU_rxFlush(char * module) {
+    if(!strcmp(module, "BT")) {
+        MM_BT_RXQ_TAIL = MM_BT_RXQ_HEAD;
+        return;
+    }
+    while (UART3->SR & UART3_SR_RXNE) {
+        (void)UART3_ReceiveData8();
+    }
+}
+
+/*
+ * Arrival time (MM_MCU_getStamp()) of the byte MM_MCU_rxReady() says is
+ * waiting, and the tick it arrived at in 'tick'. Bluetooth bytes are 
+ * stamped by the RX interrupt. T2S bytes aren't queued, so are stamped 
+ * now.
+ */
+uint16_t MM_MCU_rxStamp(char * module, uint16_t * tick) {
+    if(!strcmp(module, "BT")) {
+        *tick = MM_BT_RXQ_TICK[MM_BT_RXQ_TAIL];
+        return MM_BT_RXQ_STAMP[MM_BT_RXQ_TAIL];
+    }
+    *tick = MM_MCU_getTicks();
+    return MM_MCU_getStamp();
+}
+
+/*
+ * Wait for a byte from a module. Bluetooth bytes are queued by interrupt,
+ * so sleep until the next one (or tick, if a byte slipped in just before
+ * sleeping). The T2S UART is polled, and has no room to wait a tick.
+ */
+static void MM_MCU_idleWait(char * module) {
+    if (!strcmp(module, "BT")) {
+        MM_MCU_sleep();
+    }
+}
+
+/*
+ * Read a byte that has already arrived. Returns MM_RECV_ERROR if it was 
+ * damaged by a framing error or overrun, so callers can retry.
+ */
+static MM_recv_status MM_MCU_readByte(char * module, char * byte) {
+    uint8_t status;
+    if(!strcmp(module, "BT")) {
+        // damaged bytes were dropped by UART1_RX_IRQHandler
+        *byte = MM_BT_RXQ[MM_BT_RXQ_TAIL];
+        MM_BT_RXQ_TAIL = (MM_BT_RXQ_TAIL + 1) & (MM_RXQ_SIZE - 1);
+        return MM_RECV_OK;
+    }
+    status = UART3->SR;
+    *byte = UART3_ReceiveData8();
+    return (status & (UART3_SR_OR | UART3_SR_FE)) ? 
+           MM_RECV_ERROR : MM_RECV_OK;
+}
+
 /*
  * Recieve a single byte from a module via UART.
  * 'module' argmument must be either "BT" or "T2S"
+ * Waits for ever, so only call once MM_MCU_rxReady() or use 
+ * MM_MCU_recvByteUntil().
  */
 char MM_MCU_recvByte(char * module) {
-    // send byte to BT module
-    if(strcmp(module, "BT")) {
-        // Wait until byte is entirely received by UART1
-        while (UART1_GetFlagStatus(UART1_FLAG_RXNE) == RESET){}
-        /* Store the received byte in the RxBuffer1 */
-        return UART1_ReceiveData8();
+    char byte;
+    while (!MM_MCU_rxReady(module)) {
+        MM_MCU_idleWait(module);
+    }
+    MM_MCU_readByte(module, &byte);
+    return byte;
+}
 
+/*
+ * Recieve a single byte from a module, giving up at deadline (in system 
+ * ticks, see MM_MCU_deadline()). byte is only valid for MM_RECV_OK.
+ */
+MM_recv_status MM_MCU_recvByteUntil(char * module, uint16_t deadline, 
+                                    char * byte) {
+    while (!MM_MCU_rxReady(module)) {
+        if (MM_MCU_expired(deadline)) {
+            return MM_RECV_TIMEOUT;
+        }
+        MM_MCU_idleWait(module);
     }
-    else if(strcmp(module, "T2S")) {
-        // Wait until byte is entirely recieved by UART3
-        while (UART3_GetFlagStatus(UART3_FLAG_RXNE) == RESET){}
-        // Write one byte in the UART1 Transmit Data Register
-        return UART3_ReceiveData8();
+    return MM_MCU_readByte(module, byte);
+}
+
+/*
+ * Output shadows, changed freely by MM_MCU_setLED(), MM_MCU_setMotor() and
+ * MM_MCU_setDrive(), and published to the control loop once per FSM tick
+ * by MM_MCU_commitOutputs().
+ */
+uint8_t MM_OUT_A = 0;
+uint8_t MM_OUT_B = 0;
+// full throttle so MM_MCU_setMotor() alone still works
+MM_q15 MM_OUT_THROTTLE = MM_Q15_MAX;
+MM_q15 MM_OUT_TURN = 0;
+// shadows as last published, read by the control loop
+static uint8_t MM_CTRL_OUT_A = 0;
+static uint8_t MM_CTRL_OUT_B = 0;
+static MM_q15 MM_CTRL_THROTTLE = MM_Q15_MAX;
+static MM_q15 MM_CTRL_TURN = 0;
+// shadow values last written to the ports
+static uint8_t MM_OUT_A_LAST = 0;
+static uint8_t MM_OUT_B_LAST = 0;
+
+// port B pin for each motor, indexed by MM_motor
+static const uint8_t MM_MOTOR_PIN[MM_NUM_MOTORS] = {
+#define MM_X_MOTOR_PIN(dev, port, pin) [dev] = (1 << (pin)),
+    MM_MOTOR_PINS(MM_X_MOTOR_PIN)
+#undef MM_X_MOTOR_PIN
+};
+
+INTERRUPT_HANDLER(TIM2_UPD_OVF_BRK_IRQHandler, 13) {
+    uint16_t count;
+
+    // start of PWM period
+    GPIOB->ODR |= MM_PWM_ON;
+    TIM2->SR1 = (uint8_t)~TIM2_SR1_UIF;
+    // TIM2 counts from 0 at the update. Reading the high byte latches 
+    // the low byte.
+    count = (uint16_t)TIM2->CNTRH << 8;
+    count |= TIM2->CNTRL;
+    MM_MCU_irqLatency(MM_IRQ_LAT_PWM, 
+                      (count * MM_CLOCK_TABLE[MM_CLK].pwm_us) >> 4);
+}
+
+INTERRUPT_HANDLER(TIM2_CAP_COM_IRQHandler, 14) {
+    uint8_t flags = TIM2->SR1 & (TIM2_SR1_CC1IF | TIM2_SR1_CC2IF);
+    // end of each motor's on time
+    if (flags & TIM2_SR1_CC1IF) {
+        GPIOB->ODR &= (uint8_t)~MM_MOTOR_PIN[MM_MOTOR_L];
+    }
+    if (flags & TIM2_SR1_CC2IF) {
+        GPIOB->ODR &= (uint8_t)~MM_MOTOR_PIN[MM_MOTOR_R];
+    }
+    TIM2->SR1 = (uint8_t)~flags;
+}
+
+/*
+ * Write a motor's duty to its TIM2 compare register. A compare value of 
+ * the PWM period never matches, so full duty stays on without glitching.
+ * Returns 0 if the duty rounds to nothing.
+ */
+static uint8_t MM_MCU_writeDuty(MM_motor MM_MOTOR, MM_q15 duty) {
+    uint16_t ccr = MM_FX_scale15(duty, MM_CLOCK_TABLE[MM_CLK].pwm);
+    if (ccr != MM_PWM_CCR_LAST[MM_MOTOR]) {
+        if (MM_MOTOR == MM_MOTOR_L) {
+            TIM2_SetCompare1(ccr);
+        }
+        else {
+            TIM2_SetCompare2(ccr);
+        }
+        MM_PWM_CCR_LAST[MM_MOTOR] = ccr;
+    }
+    return ccr != 0;
+}
+
+#if MM_ENCODER != MM_ENCODER_NONE
+/*
+ * Wheel speed matching, see MM_speed.c. Edges from each wheel encoder are
+ * counted by TIM1_CAP_COM_IRQHandler, or by the simulated wheels.
+ */
+static uint16_t MM_ENC_COUNT[MM_NUM_MOTORS];
+static uint16_t MM_ENC_LAST[MM_NUM_MOTORS];
+// control steps since last speed loop run
+static uint8_t MM_SPEED_STEP = 0;
+#if MM_ENCODER == MM_ENCODER_SIM
+// duty last written to each motor, drives the simulated wheels
+static MM_q15 MM_PWM_DUTY[MM_NUM_MOTORS];
+#endif
+
+/*
+ * Run speed loop every MM_SPEED_PERIOD_MS. Called from the control loop.
+ */
+static void MM_MCU_speedTick(void) {
+    MM_ramp * left = &MM_MOTOR_RAMP[MM_MOTOR_L];
+    MM_ramp * right = &MM_MOTOR_RAMP[MM_MOTOR_R];
+    uint16_t count_l;
+    uint16_t count_r;
+#if MM_ENCODER == MM_ENCODER_SIM
+    uint8_t ms;
+
+    // simulated wheels move in 1ms steps
+    for (ms = 0; ms < MM_CTRL_PERIOD_MS; ms++) {
+        MM_SPEED_simTick(MM_PWM_DUTY[MM_MOTOR_L], MM_PWM_DUTY[MM_MOTOR_R],
+                         &MM_ENC_COUNT[MM_MOTOR_L], &MM_ENC_COUNT[MM_MOTOR_R]);
+    }
+#endif
+    if (++MM_SPEED_STEP < (MM_SPEED_PERIOD_MS / MM_CTRL_PERIOD_MS)) {
+        return;
+    }
+    MM_SPEED_STEP = 0;
+
+    // counted by a higher priority ISR
+    __critical {
+        count_l = MM_ENC_COUNT[MM_MOTOR_L];
+        count_r = MM_ENC_COUNT[MM_MOTOR_R];
+    }
+    // only match speeds when both wheels are asked for the same duty
+    MM_SPEED_update(count_l - MM_ENC_LAST[MM_MOTOR_L],
+                    count_r - MM_ENC_LAST[MM_MOTOR_R],
+                    (left->target > 0) && (left->target == right->target));
+    MM_ENC_LAST[MM_MOTOR_L] = count_l;
+    MM_ENC_LAST[MM_MOTOR_R] = count_r;
+}
+#endif
+
+INTERRUPT_HANDLER(TIM1_CAP_COM_IRQHandler, 12) {
+#if MM_ENCODER == MM_ENCODER_TIM1
+    uint8_t flags = TIM1->SR1;
+    uint16_t now;
+    uint16_t edge = 0;
+
+    // capture registers hold the edge time. Reading the high byte latches
+    // the low byte, and reading the low byte clears the channel's flag.
+    now = (uint16_t)TIM1->CNTRH << 8;
+    now |= TIM1->CNTRL;
+    if (flags & TIM1_SR1_CC1IF) {
+        edge = (uint16_t)TIM1->CCR1H << 8;
+        edge |= TIM1->CCR1L;
+        MM_ENC_COUNT[MM_MOTOR_L]++;
+    }
+    if (flags & TIM1_SR1_CC2IF) {
+        // later edge when both are set, so a little optimistic
+        edge = (uint16_t)TIM1->CCR2H << 8;
+        edge |= TIM1->CCR2L;
+        MM_ENC_COUNT[MM_MOTOR_R]++;
+    }
+    // TIM1 counts at MM_TIM1_HZ, wrapping every 16ms
+    MM_MCU_irqLatency(MM_IRQ_LAT_ENCODER, 
+                      (uint16_t)(now - edge) / (MM_TIM1_HZ / 1000000UL));
+#endif
+}
+
+/*
+ * Correct a motor's ramped duty by the speed loop output, slowing the left
+ * motor and speeding up the right by MM_SPEED_CORR. Stopped motors are 
+ * left stopped.
+ */
+static MM_q15 MM_MCU_trimDuty(MM_motor MM_MOTOR, MM_q15 duty) {
+#if MM_ENCODER != MM_ENCODER_NONE
+    if (duty > 0) {
+        duty = (MM_MOTOR == MM_MOTOR_L) ? MM_FX_sub15(duty, MM_SPEED_CORR)
+                                        : MM_FX_add15(duty, MM_SPEED_CORR);
+    }
+#endif
+#if MM_ENCODER == MM_ENCODER_SIM
+    MM_PWM_DUTY[MM_MOTOR] = duty;
+#endif
+    return duty;
+}
+
+/*
+ * Advance motor ramps by one control period and write the new duties to 
+ * TIM2. Called from the control loop.
+ */
+static void MM_MCU_rampTick(void) {
+    uint8_t on = 0;
+#define MM_X_MOTOR_RAMP(dev, port, pin) \
+    if (MM_MCU_writeDuty(dev, \
+            MM_MCU_trimDuty(dev, MM_RAMP_tick(&MM_MOTOR_RAMP[dev])))) { \
+        on |= (1 << (pin)); \
+    }
+    MM_MOTOR_PINS(MM_X_MOTOR_RAMP)
+#undef MM_X_MOTOR_RAMP
+    // PWM ISRs write port B, and an e-stop arriving part way through 
+    // must win over the duties just written
+    __critical {
+        if (MM_ESTOP) {
+            MM_MCU_motorStop();
+        }
+        else {
+            // motors ramped down to nothing stop now, not at their next 
+            // compare. Motors starting up are switched on by the next 
+            // TIM2 update.
+            GPIOB->ODR &= (uint8_t)~(MM_PWM_ON & ~on);
+            MM_PWM_ON = on;
+        }
+    }
+}
+
+/*
+ * Publish the output shadows to the control loop, which applies them at
+ * its next step. Copied together so the control loop never sees half a
+ * change, eg. throttle from one FSM tick and turn from the next.
+ */
+void MM_MCU_commitOutputs(void) {
+    __critical {
+        MM_CTRL_OUT_A = MM_OUT_A;
+        MM_CTRL_OUT_B = MM_OUT_B;
+        MM_CTRL_THROTTLE = MM_OUT_THROTTLE;
+        MM_CTRL_TURN = MM_OUT_TURN;
+    }
+}
+
+/*
+ * Write published outputs to the ports, only touching a port if it has
+ * changed since the last step. Pins not in the pin map are left as they
+ * are. Called from the control loop.
+ * Motors that are on ramp to their share of the differential drive mix, 
+ * turn > 0 is right. A motor mixed to 0 or less is off. Motor ramps are 
+ * ticked next, see MM_ramp.c. 
+ * While the bluetooth link is lost the motors are held off and all LEDs
+ * flash, the shadows take over again once it is back. Emergency stop 
+ * holds the motors off with all LEDs lit until MM_MCU_estopClear().
+ * Link loss and emergency stop skip the ramp.
+ */
+static void MM_MCU_applyOutputs(void) {
+    uint8_t out_a = MM_CTRL_OUT_A;
+    uint8_t out_b = MM_CTRL_OUT_B;
+    uint8_t changed;
+    uint8_t retarget = 0;
+    MM_q15 duty[MM_NUM_MOTORS];
+    MM_q15 target;
+
+    if (MM_ESTOP) {
+        out_a = MM_LED_MASK;
+    }
+    else if (MM_LINK_LOST) {
+        // ~4Hz flash
+        out_a = (MM_TICKS & 0x80) ? MM_LED_MASK : 0;
+    }
+    if (out_a != MM_OUT_A_LAST) {
+        GPIOA->ODR = (GPIOA->ODR & (uint8_t)~MM_LED_MASK) | out_a;
+        MM_OUT_A_LAST = out_a;
+    }
+
+    duty[MM_MOTOR_L] = MM_FX_add15(MM_CTRL_THROTTLE, MM_CTRL_TURN);
+    duty[MM_MOTOR_R] = MM_FX_sub15(MM_CTRL_THROTTLE, MM_CTRL_TURN);
+    // e-stop can arrive between checking and setting ramp targets
+    __critical {
+        if (MM_LINK_LOST || MM_ESTOP) {
+            out_b = 0;
+        }
+#define MM_X_MOTOR_TARGET(dev, port, pin) \
+        if (duty[dev] <= 0) { \
+            out_b &= (uint8_t)~(1 << (pin)); \
+        } \
+        target = (out_b & (1 << (pin))) ? duty[dev] : 0; \
+        if (target != MM_MOTOR_RAMP[dev].target) { \
+            retarget = 1; \
+        } \
+        MM_RAMP_set(&MM_MOTOR_RAMP[dev], target);
+        MM_MOTOR_PINS(MM_X_MOTOR_TARGET)
+#undef MM_X_MOTOR_TARGET
+    }
+
+    changed = out_b ^ MM_OUT_B_LAST;
+    if (changed) {
+        MM_OUT_B_LAST = out_b;
+        // motors switched on or off, for trace
+#define MM_X_MOTOR_CHANGED(dev, port, pin) \
+        if (changed & (1 << (pin))) { \
+            MM_TRACE(MM_TRC_MOTOR, (dev << 1) | ((out_b >> (pin)) & 1)); \
+        }
+        MM_MOTOR_PINS(MM_X_MOTOR_CHANGED)
+#undef MM_X_MOTOR_CHANGED
+    }
+    // any new duty target completes a latency measurement, not just a 
+    // motor switching on or off, so steering changes are counted too
+    if (changed || retarget) {
+        MM_LAT_actuated();
+    }
+}
+
+/*
+ * Bluetooth activity while halted. PA5 is only an interrupt input then.
+ */
+static volatile uint8_t MM_BT_WAKE = 0;
+
+INTERRUPT_HANDLER(EXTI_PORTA_IRQHandler, 3) {
+    MM_BT_WAKE = 1;
+}
+
+INTERRUPT_HANDLER(AWU_IRQHandler, 1) {
+    // reading the status register clears the flag
+    (void)AWU_GetFlagStatus();
+}
+
+/*
+ * 1 if either motor is running or ramping towards running.
+ */
+static uint8_t MM_MCU_motorsMoving(void) {
+    uint8_t moving = 0;
+    // ramps are ticked by the control loop
+    __critical {
+#define MM_X_MOTOR_MOVING(dev, port, pin) \
+        moving |= (MM_MOTOR_RAMP[dev].value != 0) || \
+                  (MM_MOTOR_RAMP[dev].target != 0);
+        MM_MOTOR_PINS(MM_X_MOTOR_MOVING)
+#undef MM_X_MOTOR_MOVING
     }
-    // should never reach here
-    return '\0';
+    return moving;
 }
 
 /*
- * Configure an LED. argument types are declared in MM_lib.h
+ * Clock governor. Full speed while the motors run or a burst of work has
+ * asked for it (MM_MCU_clockBoost()), as the control loop takes longer 
+ * at lower clocks. Slows down once neither has been true for 
+ * MM_CLK_SLOW_AFTER_MS, leaving the CPU to wait on slow UART traffic 
+ * for less current.
  */
-void MM_MCU_setLED(MM_led MM_LED_COLOUR, MM_led_state MM_STATE){
-    // Orange LED
-    if (MM_LED_COLOUR == MM_LED_ORANGE) {
-        if (MM_STATE == MM_LED_ON) {
-            GPIO_WriteHigh(GPIOA, GPIO_PIN_3);
-        } else GPIO_WriteLow(GPIOA, GPIO_PIN_3);
+static void MM_MCU_clockGovern(void) {
+    uint16_t now = MM_MCU_getTicks();
+
+    if (MM_CLK_BOOST || MM_MCU_motorsMoving()) {
+        MM_CLK_DEMAND = now;
+        MM_MCU_setClock(1);
     }
-    //Red LED
-    if (MM_LED_COLOUR == MM_LED_RED) {
-        if (MM_STATE == MM_LED_ON) {
-            GPIO_WriteHigh(GPIOA, GPIO_PIN_2);
-        } else GPIO_WriteLow(GPIOA, GPIO_PIN_2);
+    else if ((uint16_t)(now - MM_CLK_DEMAND) >= MM_CLK_SLOW_AFTER_MS) {
+        MM_MCU_setClock(0);
     }
-    //Green LED
-    if (MM_LED_COLOUR == MM_LED_GREEN) {
-        if (MM_STATE == MM_LED_ON) {
-            GPIO_WriteHigh(GPIOA, GPIO_PIN_1);
-        } else GPIO_WriteLow(GPIOA, GPIO_PIN_1);
+}
+
+/*
+ * 1 once there's nothing for the MCU to do until the app talks to it: 
+ * no bluetooth activity for MM_IDLE_HALT_MS, motors stopped and nothing
+ * left to send or save.
+ */
+static uint8_t MM_MCU_haltReady(void) {
+    uint16_t quiet;
+
+    if (MM_IDLE_HALT_MS == 0) {
+        return 0;
     }
-    //Green LED
-    if (MM_LED_COLOUR == MM_LED_BLUE) {
-        if (MM_STATE == MM_LED_ON) {
-            GPIO_WriteHigh(GPIOA, GPIO_PIN_0);
-        } else GPIO_WriteLow(GPIOA, GPIO_PIN_0);
+    __critical {
+        quiet = MM_BT_QUIET;
     }
+    return (quiet >= MM_IDLE_HALT_MS) && !MM_MCU_motorsMoving() && 
+           MM_MCU_txIdle("BT") && MM_MCU_txIdle("T2S") && !MM_STORE_busy();
 }
 
 /*
- * Turn motors on/off. argument types are declared in MM_lib.h
+ * Active-halt until bluetooth activity. The AWU wakes the MCU every 
+ * MM_IDLE_AWU_MS, and the system tick is moved on by that much each time
+ * as TIM4 is stopped. Watchdog task ages don't move on, as halting is 
+ * the main loop's work here. A wake-up by bluetooth mid-period overcounts a 
+ * little. The byte that wakes the MCU is lost, as the UART is off, but
+ * the app repeats control frames anyway.
  */
-void MM_MCU_setMotor(MM_motor MM_MOTOR, MM_motor_state MM_STATE){
-    // Left Motor
-    if (MM_MOTOR == MM_MOTOR_L) {
-        if (MM_STATE == MM_MOTOR_ON) {
-            GPIO_WriteHigh(GPIOB, GPIO_PIN_1);
-        } else GPIO_WriteLow(GPIOB, GPIO_PIN_1);
+static void MM_MCU_activeHalt(void) {
+    MM_TRACE(MM_TRC_HALT, 1);
+    MM_BT_WAKE = 0;
+    UART1_Cmd(DISABLE);
+    GPIO_Init(GPIOA, GPIO_PIN_5, GPIO_MODE_IN_FL_IT);
+    AWU_Cmd(ENABLE);
+
+    while (!MM_BT_WAKE) {
+        halt();
+        // the IWDG keeps running, and the tick ISR that refreshes it 
+        // doesn't while halted
+        IWDG_ReloadCounter();
+        __critical {
+            MM_TICKS += MM_IDLE_AWU_MS;
+        }
+        MM_IDLE_SLEEP += (uint32_t)MM_IDLE_AWU_MS * (1000 / MM_STAMP_US);
+    }
+
+    AWU_Cmd(DISABLE);
+    GPIO_Init(GPIOA, GPIO_PIN_5, GPIO_MODE_OUT_OD_HIZ_FAST);
+    UART1_Cmd(ENABLE);
+    // wake-up counts as activity, or it would halt again straight away
+    MM_BT_ACTIVITY = 1;
+    __critical {
+        MM_BT_QUIET = 0;
+    }
+    MM_TRACE(MM_TRC_HALT, 0);
+}
+
+/*
+ * Called by the main loop when it has nothing to do. Carries on saving 
+ * the store and runs the clock governor, then sleeps until the next 
+ * interrupt, or with 'halt_ok' set and nothing happening for a while 
+ * (see MM_MCU_haltReady()), halts until bluetooth activity.
+ */
+void MM_MCU_idle(uint8_t halt_ok) {
+    MM_STORE_poll();
+    MM_MCU_clockGovern();
+    if (halt_ok && MM_MCU_haltReady()) {
+        MM_MCU_activeHalt();
+    }
+    else {
+        MM_MCU_sleep();
+    }
+}
+
+/*
+ * Share of time the CPU was awake since the last call, in tenths of a 
+ * percent. Worked in units of 128 stamps (~1ms) to stay within 32 bits.
+ */
+uint16_t MM_MCU_cpuDuty(void) {
+    uint16_t now = MM_MCU_getTicks();
+    uint32_t total = ((uint32_t)(uint16_t)(now - MM_IDLE_START) * 
+                      (1000 / MM_STAMP_US)) >> 7;
+    uint32_t sleep = MM_IDLE_SLEEP >> 7;
+
+    MM_IDLE_START = now;
+    MM_IDLE_SLEEP = 0;
+    if (total == 0) {
+        return 0;
     }
-    // Right Motor
-    if (MM_MOTOR == MM_MOTOR_R) {
-        if (MM_STATE == MM_MOTOR_ON) {
-            GPIO_WriteHigh(GPIOB, GPIO_PIN_0);
-        } else GPIO_WriteLow(GPIOB, GPIO_PIN_0);
+    if (sleep > total) {
+        sleep = total;
     }
+    return (uint16_t)(((total - sleep) * 1000) / total);
 }
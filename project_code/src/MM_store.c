@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <stm8s.h>
+#include <string.h>
+#include <MM_store.h>
+
+/**********************************************************************************
+ * @File     MM_store.c
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Wear-levelled key/value store in data EEPROM for the MiniMech
+ *           robot.
+ **********************************************************************************
+ * Values are kept as a log of records in a RAM image of one data EEPROM
+ * block. Setting a value appends a record, so the newest record for a key
+ * is the one that counts. A RAM index from each key to its newest record
+ * (MM_STORE_SLOT) makes a lookup a short copy, with no EEPROM reads or
+ * searching after boot. When the image fills up it is compacted in RAM,
+ * keeping only the newest record for each key.
+ *
+ * The image is saved by copying it forward into the next block, rotating
+ * through all MM_STORE_BLOCKS, so each block takes an equal share of the
+ * wear. Blocks are erased ahead of time, so a save is a single fast mode
+ * block program (~3ms) rather than an erase and write of each changed
+ * byte (~6ms each, always on the same cells). The STM8S208 reads program
+ * memory while writing data EEPROM, so code keeps running from flash
+ * while a block is programmed or erased, and MM_STORE_poll() just checks
+ * for the end of the operation before starting the next.
+ *
+ * The block last saved is only erased once the new one has been read back
+ * and checked, so a reset part way through a save loses that save, not
+ * what was saved before. At boot, the valid block with the highest
+ * sequence number is taken as current, and every other block that isn't
+ * blank is erased in the background.
+ *
+ * Block format (128 bytes):
+ *  magic -> MM_STORE_MAGIC, 0 once erased
+ *  count -> records in use
+ *  seq -> 1 more than the block it replaces (16-bit, wrapping)
+ *  crc -> CRC-8 of the above
+ *  records -> MM_STORE_RECS of: key + 1 (0 unused), length, value
+ *      (MM_STORE_VAL_MAX bytes, zero padded), CRC-8 of those
+ *
+ * Everything but MM_STORE_setNow() is called from the main loop, which
+ * sets MM_STORE_LOCK while it changes the store. MM_STORE_setNow() is for
+ * the tick ISR to save a watchdog miss just before the MCU resets. If it
+ * lands while MM_STORE_LOCK is set, saving would tear the main loop's
+ * change, so it gives up.
+ **********************************************************************************/
+
+#define MM_STORE_BLOCKS     FLASH_DATA_BLOCKS_NUMBER
+#define MM_STORE_RECS       15
+#define MM_STORE_MAGIC      0x4B
+// no block, or no record
+#define MM_STORE_NONE       0xFF
+
+#define MM_STORE_BIT(block) ((uint16_t)1 << (block))
+// block as mapped into memory
+#define MM_STORE_BLOCK(block) ((const MM_store_block *)(uint16_t) \
+    (FLASH_DATA_START_PHYSICAL_ADDRESS + (uint16_t)(block) * FLASH_BLOCK_SIZE))
+
+typedef struct {
+    uint8_t key;    // MM_store_key + 1, 0 for unused
+    uint8_t len;
+    uint8_t val[MM_STORE_VAL_MAX];
+    uint8_t crc;
+} MM_store_rec;
+
+typedef struct {
+    uint8_t magic;
+    uint8_t count;
+    uint16_t seq;
+    uint8_t crc;
+    MM_store_rec rec[MM_STORE_RECS];
+    uint8_t pad[FLASH_BLOCK_SIZE - 5 - MM_STORE_RECS * sizeof(MM_store_rec)];
+} MM_store_block;
+
+// bytes covered by header and record CRCs
+#define MM_STORE_HDR_CRC_LEN    4
+#define MM_STORE_REC_CRC_LEN    (sizeof(MM_store_rec) - 1)
+
+typedef char MM_STORE_BLOCK_CHECK[
+    (sizeof(MM_store_block) == FLASH_BLOCK_SIZE) ? 1 : -1];
+// room left after compaction, and a bit per block in MM_STORE_STALE
+typedef char MM_STORE_RECS_CHECK[(MM_NUM_KEYS < MM_STORE_RECS) ? 1 : -1];
+typedef char MM_STORE_BLOCKS_CHECK[(MM_STORE_BLOCKS <= 16) ? 1 : -1];
+#define MM_X_KEY_CHECK(key, len) \
+    typedef char MM_STORE_LEN_CHECK_##key[((len) <= MM_STORE_VAL_MAX) ? 1 : -1];
+MM_STORE_KEYS(MM_X_KEY_CHECK)
+#undef MM_X_KEY_CHECK
+
+static const uint8_t MM_STORE_LEN[MM_NUM_KEYS] = {
+#define MM_X_KEY_LEN(key, len) len,
+    MM_STORE_KEYS(MM_X_KEY_LEN)
+#undef MM_X_KEY_LEN
+};
+
+typedef enum {
+    MM_STORE_OP_IDLE,
+    MM_STORE_OP_SAVE,
+    MM_STORE_OP_ERASE,
+} MM_store_op;
+
+static MM_store_block MM_STORE_IMG;
+// record holding each key's value, MM_STORE_NONE if never stored
+static uint8_t MM_STORE_SLOT[MM_NUM_KEYS];
+// block holding the last image saved, and the block to save the next to
+static uint8_t MM_STORE_HEAD = MM_STORE_NONE;
+static uint8_t MM_STORE_NEXT = 0;
+// blocks waiting to be erased. All others but MM_STORE_HEAD are blank.
+static uint16_t MM_STORE_STALE = 0;
+// image changed since last saved
+static uint8_t MM_STORE_DIRTY = 0;
+static MM_store_op MM_STORE_OP = MM_STORE_OP_IDLE;
+static uint8_t MM_STORE_OP_BLOCK = 0;
+static volatile uint8_t MM_STORE_LOCK = 0;
+
+/*
+ * CRC-8, polynomial 0x07, starting from 0xFF so that a blank record
+ * doesn't check out.
+ */
+static uint8_t MM_STORE_crc(const uint8_t * data, uint8_t len) {
+    uint8_t crc = 0xFF;
+    uint8_t bit;
+
+    while (len--) {
+        crc ^= *data++;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) :
+                                 (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint8_t MM_STORE_headerOk(const MM_store_block * blk) {
+    return (blk->magic == MM_STORE_MAGIC) && (blk->count <= MM_STORE_RECS) &&
+           (blk->crc == MM_STORE_crc((const uint8_t *)blk, MM_STORE_HDR_CRC_LEN));
+}
+
+static uint8_t MM_STORE_recordsOk(const MM_store_block * blk) {
+    const MM_store_rec * rec = blk->rec;
+    uint8_t i;
+
+    for (i = 0; i < blk->count; i++, rec++) {
+        if ((rec->key == 0) || (rec->len > MM_STORE_VAL_MAX) ||
+            (rec->crc != MM_STORE_crc((const uint8_t *)rec, MM_STORE_REC_CRC_LEN))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint8_t MM_STORE_blank(uint8_t block) {
+    const uint8_t * data = (const uint8_t *)MM_STORE_BLOCK(block);
+    uint8_t i;
+
+    for (i = 0; i < FLASH_BLOCK_SIZE; i++) {
+        if (data[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Block after 'block' in rotation, stepping over the one in use.
+ */
+static uint8_t MM_STORE_after(uint8_t block) {
+    do {
+        block = (block + 1) % MM_STORE_BLOCKS;
+    } while (block == MM_STORE_HEAD);
+    return block;
+}
+
+void MM_STORE_init(void) {
+    const MM_store_block * blk;
+    uint16_t rejected = 0;
+    uint8_t best;
+    uint8_t block;
+    uint8_t key;
+    uint8_t i;
+
+    // newest block with a good header, then check its records. A save
+    // torn by a reset fails there, and the one before it is used.
+    for (;;) {
+        best = MM_STORE_NONE;
+        for (block = 0; block < MM_STORE_BLOCKS; block++) {
+            blk = MM_STORE_BLOCK(block);
+            if (!(rejected & MM_STORE_BIT(block)) && MM_STORE_headerOk(blk) &&
+                ((best == MM_STORE_NONE) ||
+                 ((int16_t)(blk->seq - MM_STORE_BLOCK(best)->seq) > 0))) {
+                best = block;
+            }
+        }
+        if ((best == MM_STORE_NONE) || MM_STORE_recordsOk(MM_STORE_BLOCK(best))) {
+            break;
+        }
+        rejected |= MM_STORE_BIT(best);
+    }
+
+    memset(MM_STORE_SLOT, MM_STORE_NONE, sizeof(MM_STORE_SLOT));
+    MM_STORE_HEAD = best;
+    if (best == MM_STORE_NONE) {
+        MM_STORE_IMG.magic = MM_STORE_MAGIC;
+    }
+    else {
+        memcpy(&MM_STORE_IMG, MM_STORE_BLOCK(best), sizeof(MM_STORE_IMG));
+        // later records replace earlier ones. Keys this firmware doesn't
+        // know stay until compaction.
+        for (i = 0; i < MM_STORE_IMG.count; i++) {
+            key = MM_STORE_IMG.rec[i].key - 1;
+            if ((key < MM_NUM_KEYS) &&
+                (MM_STORE_IMG.rec[i].len == MM_STORE_LEN[key])) {
+                MM_STORE_SLOT[key] = i;
+            }
+        }
+    }
+    MM_STORE_NEXT = MM_STORE_after(best);
+
+    // fast mode programming needs a blank block, so erase anything else
+    for (block = 0; block < MM_STORE_BLOCKS; block++) {
+        if ((block != best) && !MM_STORE_blank(block)) {
+            MM_STORE_STALE |= MM_STORE_BIT(block);
+        }
+    }
+}
+
+/*
+ * Drop all but the newest record for each key, in place.
+ */
+static void MM_STORE_compact(void) {
+    MM_store_rec * rec = MM_STORE_IMG.rec;
+    uint8_t n = 0;
+    uint8_t key;
+    uint8_t i;
+
+    for (i = 0; i < MM_STORE_IMG.count; i++) {
+        key = rec[i].key - 1;
+        if ((key < MM_NUM_KEYS) && (MM_STORE_SLOT[key] == i)) {
+            if (n != i) {
+                memcpy(&rec[n], &rec[i], sizeof(MM_store_rec));
+            }
+            MM_STORE_SLOT[key] = n++;
+        }
+    }
+    memset(&rec[n], 0, (MM_STORE_IMG.count - n) * sizeof(MM_store_rec));
+    MM_STORE_IMG.count = n;
+}
+
+/*
+ * Append a record for key to the image, unless its value is unchanged.
+ */
+static void MM_STORE_put(MM_store_key key, const uint8_t * val) {
+    uint8_t len = MM_STORE_LEN[key];
+    uint8_t slot = MM_STORE_SLOT[key];
+    MM_store_rec * rec;
+
+    if ((slot != MM_STORE_NONE) &&
+        (memcmp(MM_STORE_IMG.rec[slot].val, val, len) == 0)) {
+        return;
+    }
+    if (MM_STORE_IMG.count == MM_STORE_RECS) {
+        MM_STORE_compact();
+    }
+    rec = &MM_STORE_IMG.rec[MM_STORE_IMG.count];
+    memset(rec, 0, sizeof(MM_store_rec));
+    rec->key = key + 1;
+    rec->len = len;
+    memcpy(rec->val, val, len);
+    rec->crc = MM_STORE_crc((const uint8_t *)rec, MM_STORE_REC_CRC_LEN);
+    MM_STORE_SLOT[key] = MM_STORE_IMG.count++;
+    MM_STORE_DIRTY = 1;
+}
+
+/*
+ * Start saving the image to, or erasing, a block. Doesn't wait for the
+ * EEPROM, see MM_STORE_step().
+ */
+static void MM_STORE_start(MM_store_op op, uint8_t block) {
+    MM_STORE_OP = op;
+    MM_STORE_OP_BLOCK = block;
+    // clear any old end of operation flag
+    (void)FLASH->IAPSR;
+    FLASH_Unlock(FLASH_MEMTYPE_DATA);
+    if (op == MM_STORE_OP_ERASE) {
+        FLASH_EraseBlock(block, FLASH_MEMTYPE_DATA);
+        return;
+    }
+    MM_STORE_IMG.seq++;
+    MM_STORE_IMG.crc = MM_STORE_crc((const uint8_t *)&MM_STORE_IMG,
+                                    MM_STORE_HDR_CRC_LEN);
+    // the image is copied into the EEPROM's buffer here, so it can be
+    // changed again straight away
+    FLASH_ProgramBlock(block, FLASH_MEMTYPE_DATA, FLASH_PROGRAMMODE_FAST,
+                       (uint8_t *)&MM_STORE_IMG);
+    MM_STORE_DIRTY = 0;
+}
+
+/*
+ * Finish the operation in hand if the EEPROM is done with it, then start
+ * the next. Saves come before erasing stale blocks, except the block to
+ * save to. Returns 1 while an operation is in hand.
+ */
+static uint8_t MM_STORE_step(void) {
+    const MM_store_block * blk;
+    uint8_t block = MM_STORE_OP_BLOCK;
+
+    if (MM_STORE_OP != MM_STORE_OP_IDLE) {
+        // reading IAPSR clears the flags, so this is the only place
+        if (!(FLASH->IAPSR & (FLASH_IAPSR_EOP | FLASH_IAPSR_WR_PG_DIS))) {
+            return 1;
+        }
+        FLASH_Lock(FLASH_MEMTYPE_DATA);
+        if (MM_STORE_OP == MM_STORE_OP_SAVE) {
+            blk = MM_STORE_BLOCK(block);
+            if (MM_STORE_headerOk(blk) && (blk->seq == MM_STORE_IMG.seq) &&
+                MM_STORE_recordsOk(blk)) {
+                if (MM_STORE_HEAD != MM_STORE_NONE) {
+                    MM_STORE_STALE |= MM_STORE_BIT(MM_STORE_HEAD);
+                }
+                MM_STORE_HEAD = block;
+            }
+            else {
+                // bad block, save again to the next one
+                MM_STORE_STALE |= MM_STORE_BIT(block);
+                MM_STORE_DIRTY = 1;
+            }
+            MM_STORE_NEXT = MM_STORE_after(block);
+        }
+        else {
+            MM_STORE_STALE &= ~MM_STORE_BIT(block);
+        }
+        MM_STORE_OP = MM_STORE_OP_IDLE;
+    }
+
+    if (MM_STORE_DIRTY) {
+        block = MM_STORE_NEXT;
+        MM_STORE_start((MM_STORE_STALE & MM_STORE_BIT(block)) ?
+                       MM_STORE_OP_ERASE : MM_STORE_OP_SAVE, block);
+        return 1;
+    }
+    if (MM_STORE_STALE) {
+        for (block = 0; !(MM_STORE_STALE & MM_STORE_BIT(block)); block++);
+        MM_STORE_start(MM_STORE_OP_ERASE, block);
+        return 1;
+    }
+    return 0;
+}
+
+uint8_t MM_STORE_get(MM_store_key key, void * val) {
+    uint8_t slot;
+
+    MM_STORE_LOCK = 1;
+    slot = MM_STORE_SLOT[key];
+    if (slot != MM_STORE_NONE) {
+        memcpy(val, MM_STORE_IMG.rec[slot].val, MM_STORE_LEN[key]);
+    }
+    MM_STORE_LOCK = 0;
+    return slot != MM_STORE_NONE;
+}
+
+void MM_STORE_set(MM_store_key key, const void * val) {
+    MM_STORE_LOCK = 1;
+    MM_STORE_put(key, (const uint8_t *)val);
+    MM_STORE_LOCK = 0;
+}
+
+void MM_STORE_poll(void) {
+    MM_STORE_LOCK = 1;
+    MM_STORE_step();
+    MM_STORE_LOCK = 0;
+}
+
+uint8_t MM_STORE_busy(void) {
+    return (MM_STORE_OP != MM_STORE_OP_IDLE) || MM_STORE_DIRTY ||
+           (MM_STORE_STALE != 0);
+}
+
+/*
+ * Wait for the operation in hand and any erase the save needs, then the
+ * save itself, ~9ms at worst. Erasing the rest is left for later.
+ */
+static void MM_STORE_save(void) {
+    while (MM_STORE_step() &&
+           (MM_STORE_DIRTY || (MM_STORE_OP == MM_STORE_OP_SAVE)));
+}
+
+void MM_STORE_flush(void) {
+    MM_STORE_LOCK = 1;
+    MM_STORE_save();
+    MM_STORE_LOCK = 0;
+}
+
+uint8_t MM_STORE_setNow(MM_store_key key, const void * val) {
+    if (MM_STORE_LOCK) {
+        return 0;
+    }
+    MM_STORE_put(key, (const uint8_t *)val);
+    MM_STORE_save();
+    return 1;
+}
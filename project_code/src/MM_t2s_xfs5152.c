@@ -1,6 +1,8 @@
 #include <MM_stm8s.h>
 #include <MM_t2s_xfs5152.h>
 #include <string.h>
+#include <MM_trace.h>
+#include <MM_store.h>
 
 
 /**********************************************************************************
@@ -37,21 +39,139 @@ static char c = '\0';
 static uint8_t com_len = 0;
 static uint8_t i = 0;
 
+uint8_t MM_T2S_BUSY = 0;
+
+uint8_t MM_T2S_READY = 0;
+// earliest tick MM_T2S_getStatus() queries module again
+static uint16_t MM_T2S_NEXT_POLL = 0;
+
+// MM_T2S_initPoll() states
+typedef enum {
+    T2S_INIT_PROBE,     // send status query at current rate
+    T2S_INIT_WAIT,      // wait for status reply
+    T2S_INIT_BACKOFF,   // no answer, wait before trying again
+    T2S_INIT_DONE,
+    T2S_INIT_FAILED
+} MM_t2s_init_state;
+
+static MM_t2s_init_state MM_T2S_INIT_STATE = T2S_INIT_PROBE;
+static MM_baud_rate MM_T2S_RATE = MM_T2S_BAUD_FAST;
+static uint8_t MM_T2S_TRIES = 0;
+static uint16_t MM_T2S_WAIT_START = 0;
+static uint16_t MM_T2S_BACKOFF = MM_T2S_BACKOFF_MIN_MS;
+
 /*
- * Initialise module by checking status and confirming it is idle.
+ * Record the rate the module answered at, or MM_NUM_BAUDS if it never 
+ * did, for MM_T2S_resume().
  */
-void MM_T2S_init(void){
-    
-    retval = '\0';
-    while (retval != 0x4F) {
-        // get current status
-    MM_MCU_sendByte(0xFD, "T2S"); // start command
-    MM_MCU_sendByte(0x02, "T2S"); // size of command
-    MM_MCU_sendByte(0x01, "T2S");
-    MM_MCU_sendByte(0x21, "T2S"); //command: get current status
+static void MM_T2S_cacheBaud(MM_baud_rate rate) {
+    uint8_t val = rate;
+    MM_STORE_set(MM_KEY_T2S_BAUD, &val);
+}
+
+/*
+ * Give up on current probe. Tries the other rate straight away, or backs 
+ * off once both rates have been tried. A module that answers busy is 
+ * retried at the same rate after the backoff.
+ */
+static void MM_T2S_retry(uint8_t busy) {
+    if (!busy && (MM_T2S_RATE == MM_T2S_BAUD_FAST) && 
+        (MM_T2S_BAUD_FAST != MM_T2S_BAUD)) {
+        MM_T2S_RATE = MM_T2S_BAUD;
+        MM_T2S_INIT_STATE = T2S_INIT_PROBE;
+        return;
+    }
+    if (++MM_T2S_TRIES >= MM_T2S_INIT_RETRIES) {
+        MM_T2S_cacheBaud(MM_NUM_BAUDS);
+        MM_T2S_INIT_STATE = T2S_INIT_FAILED;
+        return;
+    }
+    if (!busy) {
+        MM_T2S_RATE = MM_T2S_BAUD_FAST;
+    }
+    MM_T2S_WAIT_START = MM_MCU_getTicks();
+    MM_T2S_INIT_STATE = T2S_INIT_BACKOFF;
+}
 
-    retval = MM_MCU_recvByte("T2S"); // 0x4F means idle
+/*
+ * Initialise module without blocking, by checking status and confirming it
+ * is idle. Call repeatedly until it stops returning MM_INIT_BUSY.
+ * 
+ * The XFS5152 has no command to change baud rate, it is set by the 
+ * module's BAUD0/BAUD1 pins. So look for it at MM_T2S_BAUD_FAST first, 
+ * falling back to the startup rate. Each pass over both rates is retried
+ * with exponential backoff, up to MM_T2S_INIT_RETRIES times. After that 
+ * the robot carries on without speech and MM_T2S_READY stays 0.
+ */
+MM_init_status MM_T2S_initPoll(void) {
+    switch (MM_T2S_INIT_STATE) {
+        case T2S_INIT_PROBE :
+            // don't change rate until last bytes have gone
+            if (!MM_MCU_txIdle("T2S")) {
+                break;
+            }
+            MM_MCU_setBaud("T2S", MM_T2S_RATE);
+            // discard anything left from a failed probe
+            while (MM_MCU_rxReady("T2S")) {
+                MM_MCU_recvByte("T2S");
+            }
+            MM_MCU_sendByte(0xFD, "T2S"); // start command
+            MM_MCU_sendByte(0x00, "T2S"); // size of command byte 1
+            MM_MCU_sendByte(0x01, "T2S"); // size of command byte 2
+            MM_MCU_sendByte(0x21, "T2S"); // command: get current status
+            MM_T2S_WAIT_START = MM_MCU_getTicks();
+            MM_T2S_INIT_STATE = T2S_INIT_WAIT;
+            break;
+        case T2S_INIT_WAIT :
+            if (MM_MCU_rxReady("T2S")) {
+                retval = MM_MCU_recvByte("T2S");
+                if (retval == 0x4F) { // idle
+                    MM_T2S_READY = 1;
+                    MM_T2S_cacheBaud(MM_T2S_RATE);
+                    MM_T2S_INIT_STATE = T2S_INIT_DONE;
+                }
+                else {
+                    // 0x4E means busy at right rate, anything else is noise
+                    MM_T2S_retry(retval == 0x4E);
+                }
+            }
+            else if ((uint16_t)(MM_MCU_getTicks() - MM_T2S_WAIT_START) >= 
+                     MM_T2S_TIMEOUT_MS) {
+                MM_T2S_retry(0);
+            }
+            break;
+        case T2S_INIT_BACKOFF :
+            if ((uint16_t)(MM_MCU_getTicks() - MM_T2S_WAIT_START) >= 
+                MM_T2S_BACKOFF) {
+                MM_T2S_BACKOFF <<= 1;
+                MM_T2S_INIT_STATE = T2S_INIT_PROBE;
+            }
+            break;
+        case T2S_INIT_DONE :
+            return MM_INIT_OK;
+        case T2S_INIT_FAILED :
+            return MM_INIT_FAIL;
     }
+    return MM_INIT_BUSY;
+}
+
+/*
+ * Pick up where the last run left off, after a watchdog or software reset
+ * of the MCU only. The module kept its power, so it is taken as ready at
+ * the rate it answered at last run without asking it, or left disabled 
+ * if it never answered.
+ */
+void MM_T2S_resume(void) {
+    uint8_t rate;
+
+    if (!MM_STORE_get(MM_KEY_T2S_BAUD, &rate) || (rate >= MM_NUM_BAUDS)) {
+        MM_T2S_INIT_STATE = T2S_INIT_FAILED;
+        return;
+    }
+    MM_T2S_RATE = (MM_baud_rate)rate;
+    MM_MCU_setBaud("T2S", MM_T2S_RATE);
+    MM_T2S_READY = 1;
+    MM_T2S_INIT_STATE = T2S_INIT_DONE;
 }
 
 /*
@@ -65,6 +185,8 @@ void MM_T2S_sendPhrase(void){
     // (without null terminator). Will have a max value of 255 total.
     com_len = (unsigned char)(strlen(MM_PHRASES[MM_PHR_INDEX]) + 6);
     
+    MM_TRACE(MM_TRC_T2S_START, MM_PHR_INDEX);
+    MM_T2S_BUSY = 1;
     // message header
     MM_MCU_sendByte(0xFD, "T2S"); // start command
     MM_MCU_sendByte(0x00, "T2S"); // size of command byte 1
@@ -76,43 +198,84 @@ void MM_T2S_sendPhrase(void){
     MM_MCU_sendByte(']', "T2S");
     
     // send phrase
-    c = MM_PHRASES[MM_PHR_INDEX][0];
     i = 0;
+    c = MM_PHRASES[MM_PHR_INDEX][0];
     while (c != '\0') {
-        MM_MCU_sendByte(MM_PHRASES[MM_PHR_INDEX][i], "T2S");
+        MM_MCU_sendByte(c, "T2S");
         i++;
+        c = MM_PHRASES[MM_PHR_INDEX][i];
     }
+    MM_TRACE(MM_TRC_T2S_END, MM_PHR_INDEX);
 }
 
-// get status from T2S module. Returns 1 if busy, 0 if idle   
-uint8_t MM_T2S_getStatus(void) {
-    
-    retval = 0x00;
-    // send get status command
+/*
+ * Send a single byte command (no data) to module and wait up to 
+ * MM_T2S_TIMEOUT_MS for the first byte of its reply. Stale bytes, eg. 
+ * acks or late replies to an earlier command, are discarded first.
+ */
+static MM_recv_status MM_T2S_command(uint8_t cmd, char * reply) {
+    while (MM_MCU_rxReady("T2S")) {
+        MM_MCU_recvByte("T2S");
+    }
     MM_MCU_sendByte(0xFD, "T2S"); // start command
     MM_MCU_sendByte(0x00, "T2S"); // size of command byte 1
     MM_MCU_sendByte(0x01, "T2S"); // size of command byte 2
-    MM_MCU_sendByte(0x21, "T2S"); // command: get status
+    MM_MCU_sendByte(cmd, "T2S");  // command
+    return MM_MCU_recvByteUntil("T2S", MM_MCU_deadline(MM_T2S_TIMEOUT_MS), 
+                                reply);
+}
 
-    if(MM_MCU_recvByte("T2S") == 0x4F) {
-        return 0;
+/*
+ * Module stopped answering. Carry on without speech, as if it had failed
+ * at startup.
+ */
+static void MM_T2S_lost(void) {
+    MM_T2S_BUSY = 0;
+    MM_T2S_READY = 0;
+}
+
+/*
+ * Get status from T2S module. Returns 1 if busy, 0 if idle. Only asks the
+ * module every MM_T2S_POLL_MS, returning the last status in between. 
+ * The query is retried up to MM_T2S_RETRIES times, after which the module
+ * is taken as lost and reported idle.
+ */
+uint8_t MM_T2S_getStatus(void) {
+    uint8_t tries;
+
+    if (!MM_MCU_expired(MM_T2S_NEXT_POLL)) {
+        return MM_T2S_BUSY;
+    }
+    MM_T2S_NEXT_POLL = MM_MCU_deadline(MM_T2S_POLL_MS);
+
+    for (tries = 0; tries < MM_T2S_RETRIES; tries++) {
+        // command: get status. 0x4E means busy, 0x4F means idle
+        if ((MM_T2S_command(0x21, &retval) == MM_RECV_OK) && 
+            ((retval == 0x4E) || (retval == 0x4F))) {
+            MM_T2S_BUSY = (retval == 0x4E);
+            return MM_T2S_BUSY;
+        }
     }
-    else return 1;  
+    MM_T2S_lost();
+    return MM_T2S_BUSY;
 }
 
 /*
  * Stop phrase and await confirmation that module has returned to idle
- * state.
+ * state. Retried up to MM_T2S_RETRIES times, after which the module is
+ * taken as lost.
  */
 void MM_T2S_stopPhrase(void){
-    // wait until speech finishes
-    retval = '\0';
-    while(retval != '0x4F') {
-        MM_MCU_sendByte(0xFD, "T2S"); // start command
-        MM_MCU_sendByte(0x00, "T2S"); // size of command byte 1
-        MM_MCU_sendByte(0x01, "T2S"); // size of command byte 2
-        MM_MCU_sendByte(0x02, "T2S"); // command: stop talking
-
-        retval = MM_MCU_recvByte("T2S"); //0x4F means idle
+    uint8_t tries;
+
+    for (tries = 0; tries < MM_T2S_RETRIES; tries++) {
+        // command: stop talking. Reply is just an ack, so check status
+        MM_T2S_command(0x02, &retval);
+        if ((MM_T2S_command(0x21, &retval) == MM_RECV_OK) && 
+            (retval == 0x4F)) {
+            MM_T2S_BUSY = 0;
+            return;
+        }
     }
-}
\ No newline at end of file
+    MM_T2S_lost();
+}
@@ -0,0 +1,104 @@
+#include <stdint.h>
+#include <MM_telemetry.h>
+#include <MM_stm8s.h>
+#include <MM_t2s_xfs5152.h>
+
+/**********************************************************************************
+ * @File     MM_telemetry.c
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Periodic runtime telemetry for the MiniMech robot.
+ **********************************************************************************
+ * A telemetry frame is sent to the app via bluetooth every MM_TLM_PERIOD_MS
+ * (changeable at runtime by the app). Frames are only queued when the whole 
+ * frame fits in the bluetooth transmit queue, so sending never holds up the
+ * main loop. A frame that doesn't fit is retried on the next poll.
+ * 
+ * Frame format (16-bit values MSB first):
+ *  0xA5 0x54 -> sync bytes
+ *  tick -> system tick when frame was built (ms)
+ *  loop rate -> main loop iterations per second
+ *  rx bytes, tx bytes -> bluetooth UART byte counts (wrapping)
+ *  overrun, framing, noise -> bluetooth UART error counts (wrapping)
+ *  ram free -> bytes between static data and stack pointer
+ *  stack headroom -> least free RAM seen below the stack (high-water mark)
+ *  static RAM -> bytes of static data
+ *  speech -> 1 if T2S module is speaking (8-bit)
+ *  T2S queue -> bytes waiting to be sent to T2S module (8-bit)
+ *  control steps, overruns -> control loop counts (wrapping)
+ *  late max, jitter, busy max -> control loop timing since last frame, 
+ *      8-bit in units of MM_STAMP_US (see MM_ctrl_stats)
+ *  CPU duty -> share of time awake since last frame, in 0.1%
+ *  clock -> current clock level (MM_clock, 8-bit)
+ *  watchdog misses, last -> deadline misses saved over resets, and the 
+ *      task that missed last (MM_WDG_MISSES, MM_WDG_LAST, 8-bit each)
+ **********************************************************************************/
+
+uint16_t MM_TLM_LOOPS = 0;
+
+static uint16_t MM_TLM_PERIOD = MM_TLM_PERIOD_MS;
+// tick and loop count at last frame
+static uint16_t MM_TLM_LAST_TICK = 0;
+static uint16_t MM_TLM_LAST_LOOPS = 0;
+
+static void MM_TLM_send16(uint16_t val) {
+    MM_MCU_sendByte(val >> 8, "BT");
+    MM_MCU_sendByte(val & 0xFF, "BT");
+}
+
+void MM_TLM_setPeriod(uint16_t period_ms) {
+    MM_TLM_PERIOD = period_ms;
+    MM_TLM_LAST_TICK = MM_MCU_getTicks();
+    MM_TLM_LAST_LOOPS = MM_TLM_LOOPS;
+}
+
+void MM_TLM_poll(void) {
+    uint16_t now = MM_MCU_getTicks();
+    uint16_t elapsed = now - MM_TLM_LAST_TICK;
+    uint16_t loops;
+    MM_uart_stats stats;
+    MM_ctrl_stats ctrl;
+
+    if ((MM_TLM_PERIOD == 0) || (elapsed < MM_TLM_PERIOD)) {
+        return;
+    }
+    // don't wait on the UART, try again next time round
+    if (MM_MCU_txFree("BT") < MM_TLM_FRAME_LEN) {
+        return;
+    }
+    loops = MM_TLM_LOOPS - MM_TLM_LAST_LOOPS;
+    MM_TLM_LAST_TICK = now;
+    MM_TLM_LAST_LOOPS = MM_TLM_LOOPS;
+
+    // TX count is updated by the UART1 TX interrupt
+    __critical {
+        stats = MM_BT_STATS;
+    }
+    MM_MCU_ctrlStats(&ctrl);
+
+    MM_MCU_sendByte(MM_TLM_SYNC_1, "BT");
+    MM_MCU_sendByte(MM_TLM_SYNC_2, "BT");
+    MM_TLM_send16(now);
+    MM_TLM_send16((uint16_t)(((uint32_t)loops * 1000) / elapsed));
+    MM_TLM_send16(stats.rx_bytes);
+    MM_TLM_send16(stats.tx_bytes);
+    MM_TLM_send16(stats.overrun);
+    MM_TLM_send16(stats.framing);
+    MM_TLM_send16(stats.noise);
+    MM_TLM_send16(MM_MCU_ramFree());
+    MM_TLM_send16(MM_MCU_stackUnused());
+    MM_TLM_send16(MM_MCU_ramStatic());
+    MM_MCU_sendByte(MM_T2S_BUSY, "BT");
+    MM_MCU_sendByte(MM_MCU_txPending("T2S"), "BT");
+    MM_TLM_send16(ctrl.steps);
+    MM_TLM_send16(ctrl.overruns);
+    MM_MCU_sendByte(ctrl.late_max, "BT");
+    // no steps since last frame leaves min above max
+    MM_MCU_sendByte((ctrl.late_max >= ctrl.late_min) ? 
+                    (ctrl.late_max - ctrl.late_min) : 0, "BT");
+    MM_MCU_sendByte(ctrl.busy_max, "BT");
+    MM_TLM_send16(MM_MCU_cpuDuty());
+    MM_MCU_sendByte(MM_MCU_getClock(), "BT");
+    MM_MCU_sendByte(MM_WDG_MISSES, "BT");
+    MM_MCU_sendByte(MM_WDG_LAST, "BT");
+}
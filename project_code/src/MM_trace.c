@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <MM_trace.h>
+#include <MM_stm8s.h>
+
+/**********************************************************************************
+ * @File     MM_trace.c
+ * @AUthor   Daniel Babekuhl
+ * @Date     7th June 2020
+ * @Brief    Event trace buffer for the MiniMech robot.
+ **********************************************************************************
+ * Records are written into a fixed size ring, overwriting the oldest record
+ * once full. Writing a record only takes an index update and three stores,
+ * with interrupts held off so it can be used from interrupt handlers.
+ * 
+ * Dump format (sent to app via bluetooth):
+ *  0xA5 0x5A -> sync bytes
+ *  0xXX -> number of records that follow
+ *  records, oldest first, 4 bytes each:
+ *      event id, arg, tick (MSB), tick (LSB)
+ * 
+ * tools/MM_trace_decode.py decodes a dump into a timeline.
+ **********************************************************************************/
+
+// trace ring
+static MM_trace_rec MM_TRACE_BUF[MM_TRACE_SIZE];
+// index of next record to write
+static volatile uint8_t MM_TRACE_HEAD = 0;
+// set once ring has wrapped
+static volatile uint8_t MM_TRACE_FULL = 0;
+
+/*
+ * Record an event at the current system tick.
+ */
+void MM_TRACE_log(uint8_t event, uint8_t arg) {
+    MM_trace_rec * rec;
+    __critical {
+        rec = &MM_TRACE_BUF[MM_TRACE_HEAD];
+        rec->event = event;
+        rec->arg = arg;
+        rec->tick = MM_TICKS;
+        MM_TRACE_HEAD = (MM_TRACE_HEAD + 1) & (MM_TRACE_SIZE - 1);
+        if (MM_TRACE_HEAD == 0) {
+            MM_TRACE_FULL = 1;
+        }
+    }
+}
+
+/*
+ * Send trace buffer to app. Records logged while dumping may overwrite
+ * the oldest records, so snapshot the ring position first.
+ */
+void MM_TRACE_dump(void) {
+    uint8_t head;
+    uint8_t count;
+    uint8_t idx;
+    MM_trace_rec rec;
+
+    __critical {
+        head = MM_TRACE_HEAD;
+        count = MM_TRACE_FULL ? MM_TRACE_SIZE : head;
+    }
+    // oldest record is at head once ring has wrapped
+    idx = (head - count) & (MM_TRACE_SIZE - 1);
+
+    MM_MCU_sendByte(MM_TRACE_SYNC_1, "BT");
+    MM_MCU_sendByte(MM_TRACE_SYNC_2, "BT");
+    MM_MCU_sendByte(count, "BT");
+    while (count--) {
+        __critical {
+            rec = MM_TRACE_BUF[idx];
+        }
+        MM_MCU_sendByte(rec.event, "BT");
+        MM_MCU_sendByte(rec.arg, "BT");
+        MM_MCU_sendByte(rec.tick >> 8, "BT");
+        MM_MCU_sendByte(rec.tick & 0xFF, "BT");
+        idx = (idx + 1) & (MM_TRACE_SIZE - 1);
+    }
+}
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+MM_ram_report.py
+
+Static RAM report for the MiniMech firmware, taken from the SDCC linker
+map (MiniMech.map). Lists the size of each RAM area, a per-module
+breakdown of static data, and what is left over for the stack.
+
+Per-module sizes are attributed from global symbol addresses, so a
+module's file-static variables are counted with the global symbol that
+precedes them in the same area.
+
+Usage:
+    MM_ram_report.py MiniMech.map [--ram-end 0x17FF] [--stack-min 512]
+"""
+
+import argparse
+import re
+import sys
+from collections import OrderedDict
+
+# areas placed in RAM by the SDCC STM8 port
+RAM_AREAS = ("DATA", "INITIALIZED")
+
+AREA_RE = re.compile(r"^(\w+)\s+([0-9A-Fa-f]+)\s+([0-9A-Fa-f]+)\s+=\s+(\d+)\.\s+bytes")
+SYM_RE = re.compile(r"^\s+([0-9A-Fa-f]{4,8})\s+(\S+)\s+(\S+)\s*$")
+
+
+def parse_map(path):
+    """Return {area: (start, size, [(addr, symbol, module), ...])}."""
+    areas = OrderedDict()
+    current = None
+    with open(path) as f:
+        for line in f:
+            m = AREA_RE.match(line)
+            if m:
+                name = m.group(1)
+                current = name if name in RAM_AREAS else None
+                if current:
+                    areas[current] = (int(m.group(2), 16), int(m.group(4)), [])
+                continue
+            if current:
+                m = SYM_RE.match(line)
+                if m and m.group(2).startswith("_"):
+                    areas[current][2].append((int(m.group(1), 16), m.group(2)[1:], m.group(3)))
+    return areas
+
+
+def module_sizes(areas):
+    sizes = OrderedDict()
+    for name, (start, size, syms) in areas.items():
+        syms = sorted(syms)
+        end = start + size
+        for i, (addr, sym, module) in enumerate(syms):
+            nxt = syms[i + 1][0] if i + 1 < len(syms) else end
+            sizes.setdefault(module, 0)
+            sizes[module] += nxt - addr
+        # bytes before the first global symbol belong to an unnamed module
+        if syms and syms[0][0] > start:
+            sizes.setdefault("(static)", 0)
+            sizes["(static)"] += syms[0][0] - start
+        elif not syms and size:
+            sizes.setdefault("(static)", 0)
+            sizes["(static)"] += size
+    return sizes
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("map", help="SDCC linker map file")
+    ap.add_argument("--ram-end", type=lambda v: int(v, 0), default=0x17FF,
+                    help="last RAM address (default 0x17FF, STM8S208)")
+    ap.add_argument("--stack-min", type=int, default=512,
+                    help="warn if less than this is left for the stack")
+    args = ap.parse_args()
+
+    try:
+        areas = parse_map(args.map)
+    except OSError as e:
+        sys.exit("MM_ram_report: %s" % e)
+    if not areas:
+        sys.exit("MM_ram_report: no RAM areas found in %s" % args.map)
+
+    print("RAM areas:")
+    data_end = 0
+    for name, (start, size, _) in areas.items():
+        print("  %-12s 0x%04X  %5d bytes" % (name, start, size))
+        data_end = max(data_end, start + size)
+
+    print("\nStatic data by module:")
+    sizes = module_sizes(areas)
+    for module, size in sorted(sizes.items(), key=lambda kv: -kv[1]):
+        print("  %-20s %5d bytes" % (module, size))
+
+    stack = args.ram_end + 1 - data_end
+    print("\nStatic data ends at 0x%04X, %d bytes left for stack" % (data_end, stack))
+    if stack < args.stack_min:
+        print("WARNING: less than %d bytes left for stack" % args.stack_min)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""
+MM_trace_decode.py
+
+Decode a MiniMech event trace dump (see project_code/src/MM_trace.c) into a
+timeline. Reads the raw bytes sent by the robot in response to the trace
+command byte (0x81), either from a capture file or directly from a serial
+port (requires pyserial).
+
+Usage:
+    MM_trace_decode.py capture.bin
+    MM_trace_decode.py --port /dev/rfcomm0 [--baud 9600]
+"""
+
+import argparse
+import sys
+
+SYNC = b"\xA5\x5A"
+TRACE_CMD = 0x81
+
+# keep in step with MM_trace_event in MM_trace.h
+EVENTS = ["STATE", "BT_RX", "T2S_START", "T2S_END", "MOTOR", "LINK", "HALT",
+          "CLOCK", "BOOT"]
+# keep in step with _state in MM_main.c
+STATES = ["STARTUP", "PHRASE", "STEER", "MOVE", "SPEAK"]
+MOTORS = ["L", "R"]
+# keep in step with MM_CLOCKS in MM_stm8s.h
+CLOCKS = ["HSI_FAST", "HSI_SLOW", "HSE_FAST", "HSE_SLOW"]
+# keep in step with MM_reset_cause in MM_stm8s.h
+RESETS = ["COLD", "WATCHDOG", "SOFTWARE"]
+
+
+def describe(event, arg):
+    name = EVENTS[event] if event < len(EVENTS) else "EV%d" % event
+    if name == "STATE":
+        detail = STATES[arg] if arg < len(STATES) else str(arg)
+    elif name == "BT_RX":
+        detail = "0x%02X" % arg
+    elif name in ("T2S_START", "T2S_END"):
+        detail = "phrase %d" % arg
+    elif name == "MOTOR":
+        detail = "%s %s" % (MOTORS[(arg >> 1) & 1], "ON" if arg & 1 else "OFF")
+    elif name == "LINK":
+        detail = "LOST" if arg else "OK"
+    elif name == "HALT":
+        detail = "ENTER" if arg else "WAKE"
+    elif name == "CLOCK":
+        detail = CLOCKS[arg] if arg < len(CLOCKS) else str(arg)
+    elif name == "BOOT":
+        detail = RESETS[arg] if arg < len(RESETS) else str(arg)
+    else:
+        detail = str(arg)
+    return name, detail
+
+
+def parse(data):
+    start = data.find(SYNC)
+    if start < 0 or start + 3 > len(data):
+        raise ValueError("no trace dump found")
+    count = data[start + 2]
+    body = data[start + 3:start + 3 + count * 4]
+    if len(body) < count * 4:
+        raise ValueError("truncated dump: expected %d records" % count)
+    records = []
+    for i in range(count):
+        event, arg, hi, lo = body[i * 4:i * 4 + 4]
+        records.append((event, arg, (hi << 8) | lo))
+    return records
+
+
+def timeline(records):
+    # ticks are 16-bit ms counts, unwrap so the timeline is monotonic
+    lines = []
+    base = None
+    prev = None
+    offset = 0
+    last = None
+    for event, arg, tick in records:
+        if last is not None and tick < last:
+            offset += 0x10000
+        last = tick
+        t = tick + offset
+        if base is None:
+            base = prev = t
+        name, detail = describe(event, arg)
+        lines.append("%8d ms  %+6d  %-10s %s" % (t - base, t - prev, name, detail))
+        prev = t
+    return lines
+
+
+def read_port(port, baud):
+    import serial
+    with serial.Serial(port, baud, timeout=2) as ser:
+        ser.write(bytes([TRACE_CMD]))
+        data = ser.read(3 + 4 * 128 + 16)
+    return data
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("capture", nargs="?", help="raw dump file")
+    ap.add_argument("--port", help="serial port to request dump from")
+    ap.add_argument("--baud", type=int, default=9600)
+    args = ap.parse_args()
+
+    if args.port:
+        data = read_port(args.port, args.baud)
+    elif args.capture:
+        with open(args.capture, "rb") as f:
+            data = f.read()
+    else:
+        ap.error("give a capture file or --port")
+
+    try:
+        records = parse(data)
+    except ValueError as e:
+        sys.exit("MM_trace_decode: %s" % e)
+    print("%8s     %6s  %-10s %s" % ("time", "delta", "event", "detail"))
+    for line in timeline(records):
+        print(line)
+
+
+if __name__ == "__main__":
+    main()